@@ -22,11 +22,14 @@
 */
 
 #define NCURSES_WIDECHAR 1
+/* For wcwidth() with glibc */
+#define _GNU_SOURCE
 
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <sys/types.h>
@@ -34,6 +37,7 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <locale.h>
+#include <wchar.h>
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -71,27 +75,410 @@
 #include <termio.h>
 #endif
 
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#endif
+
+/* --export hands the output to a thread of its own, without locks */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_STDATOMIC_H)
+#define USE_EXPORT
+#endif
+
+/* SSE2 and AVX2 versions of the update step, picked at run time */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_SIMD
+#include <immintrin.h>
+#endif
+
 #ifdef __CYGWIN__
 #define TIOCSTI 0x5412
 #endif
 
-/* Matrix typedef */
-typedef struct cmatrix {
-    int val;
-    bool is_head;
-} cmatrix;
+/* Cell attributes as the output backends see them: a color pair number
+   (also the foreground color, 0 being the terminal's default) and flags */
+#define ATTR_COLOR 0xff
+#define ATTR_BOLD 0x100
+#define ATTR_ALTCHARSET 0x200
+
+/* Output backends */
+enum {
+    BACKEND_NCURSES,
+    BACKEND_ANSI
+};
+
+/* How new-style columns are stepped */
+enum {
+    ENGINE_DENSE,  /* Go over every cell */
+    ENGINE_SPARSE  /* Go over the streams */
+};
+
+/* Instruction sets the dense engine can scan and change cells with */
+enum {
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+/* Frame buffer of the ANSI backend. A whole frame of cursor moves, SGR
+   sequences and UTF-8 glyphs is built here and sent with one write(). */
+typedef struct ansi_out {
+    int fd;
+    int *more;     /* Other terminals the same frames go to, with -t */
+    int nmore;
+    char *buf;
+    size_t len;
+    size_t size;
+    int row, col;  /* Where the cursor is, -1 if we don't know */
+    int attr;      /* Attributes in effect, -1 if we don't know */
+    unsigned long long written; /* Bytes written so far */
+} ansi_out;
+
+/* A glyph encoded once for each backend, so drawing a cell doesn't
+   convert anything: UTF-8 for ansi, a cchar_t without attributes for
+   ncurses */
+typedef struct glyph {
+    int ch;
+    char utf8[4];
+    int len;
+    cchar_t cc;
+} glyph;
+
+/* The state of a column, apart from its cells */
+typedef struct column {
+    uint64_t rng;  /* Its random number generator */
+    int length;    /* Length of the stream */
+    int spaces;    /* Spaces left to fill */
+    int updates;   /* Frames out of 4 it sits out, with -a */
+    int offset;    /* Ring buffer start (old-style) */
+    int scrolled;  /* Old-style scroll steps not drawn yet */
+    int first;     /* Its top stream in its ring of them (sparse engine) */
+    int nstreams;  /* How many streams there are in it (sparse engine) */
+} column;
+
+/* A stream of glyphs falling down a column, from storage row top down to
+   its head at bottom. The sparse engine keeps a ring of them for each
+   column, top to bottom, and only touches their ends. */
+typedef struct stream {
+    int top, bottom;
+} stream;
+
+/* A terminal given with -t, when there's more than one */
+typedef struct tty_out {
+    char *path;
+    int fd;
+    int lines, cols;  /* Size it was last seen at, -1 before that */
+    int group;        /* Index of its group in groups */
+} tty_out;
+
+/* Terminals of the same size make up a group, which has a simulation of
+   its own. Each frame is built once for the group and written to every
+   terminal in it. The group in use has its simulation in the globals;
+   the others have theirs here, see group_use. */
+typedef struct screen_group {
+    int lines, cols;  /* Never change, terminals change groups instead */
+    char *arena;
+    int cell_rows, cell_cols;
+    column *columns;
+    int *cell_val;
+    bool *cell_head, *cell_dirty;
+    uint32_t *rand_block;
+    stream *streams;
+    int stream_cap;
+    int count;
+    ansi_out out;
+    int *fds;         /* Its terminals, which out writes to */
+} screen_group;
+
+/* A --record file being written. After the magic comes a frame at a
+   time: microseconds since the last frame, 1 if the screen size follows
+   (then lines and columns), the length of the cells and the cells drawn,
+   packed by record_run. Numbers are all varints. */
+typedef struct recorder {
+    FILE *out;
+    unsigned char *buf; /* Cells of the frame being drawn */
+    size_t len;
+    size_t size;
+    int lines, cols;    /* Screen size positions count in */
+    int resized;        /* Size changed since the last frame */
+    int pos;            /* Position of the last cell written, -1 for none */
+    int attr;           /* Attributes of the last cell written */
+    /* Like cells held back, to go out as one run */
+    int run_pos, run_count, run_step, run_ch, run_attr;
+    int64_t last;       /* When the last frame was written */
+} recorder;
+
+/* A --replay file being played back, and what it drew so far, to draw
+   again after a resize */
+typedef struct player {
+    FILE *in;
+    unsigned char *buf; /* Cells of the next frame */
+    size_t len;
+    size_t size;
+    int lines, cols;    /* Screen size positions count in */
+    int *ch;            /* Glyph of each cell, 0 if nothing was drawn */
+    int *attr;
+    glyph cache[256];   /* Glyphs encoded so far, by code point modulo 256 */
+} player;
+
+/* The -M/-L message, laid out once whenever it's set: a box with a line
+   of blanks above and below and two columns of them either side, each
+   line of text centered in it. The draw kernels leave the cells under it
+   alone, so it only has to be drawn when the whole screen is. */
+typedef struct message_box {
+    int *cells;         /* Code point of each cell, a row at a time */
+    int width, height;  /* 0 x 0 without a message */
+    int top, left;      /* Where it is on the screen being drawn */
+    /* The box the next frame blanks, as it was last drawn: its size,
+       and that of the screen it was in the middle of, -1 x -1 for the
+       one being drawn. 0 x 0 for none. */
+    int erase_width, erase_height, erase_lines, erase_cols;
+    char *path;         /* --message-file, read again when it changes */
+    time_t mtime;       /* What the file was like when it was read */
+    off_t size;
+    ino_t ino;
+} message_box;
+
+/* What --hash-frames has drawn on the screen so far */
+typedef struct screen_copy {
+    int *ch;            /* Code point of each cell, 0 if nothing was drawn */
+    int *attr;
+    int lines, cols;
+} screen_copy;
+
+#ifdef USE_EXPORT
+/* The --export ring buffer between the main thread, which puts the bytes
+   of each frame in as they go to the terminal, and the writer thread,
+   which takes them out and writes them to the file. Each one only ever
+   moves its own end along. */
+typedef struct exporter {
+    FILE *out;
+    char *path;
+    int cast;            /* Write asciicast, not just the bytes */
+    unsigned char *ring; /* EXPORT_RING bytes */
+    atomic_size_t head;  /* Bytes put in so far */
+    atomic_size_t tail;  /* Bytes taken out so far */
+    atomic_int done;     /* Write out what's left and stop */
+    pthread_t thread;
+    int64_t start;       /* When the export started */
+    time_t started;
+    unsigned long dropped; /* Output that didn't fit in the ring */
+    /* The writer thread's own */
+    unsigned char *scratch;
+    int lines, cols;     /* Screen size of the last chunk written */
+} exporter;
+
+/* Output of a frame, as it sits in the ring in front of its bytes */
+typedef struct export_chunk {
+    int64_t time;        /* Nanoseconds into the export */
+    int lines, cols;
+    size_t len;
+} export_chunk;
+
+/* Size of the --export ring, a power of two */
+#define EXPORT_RING (1 << 22)
+#endif
+
+/* --max-bandwidth: how much output may go out, and what came of it */
+typedef struct throttle {
+    int on;
+    double limit;          /* Bytes per second given, 0 for none */
+    double rate;           /* Bytes per second going out, 0 for no limit yet */
+    double budget;         /* Bytes that may go out now, below 0 if over */
+    int64_t start;         /* When the first frame was due */
+    int64_t last;          /* When budget was last topped up */
+    int row;               /* Row a capped frame starts from, see draw_capped */
+    int behind;            /* The last frame was cut short */
+    unsigned long held;    /* Frames held back */
+    unsigned long capped;  /* Frames cut short */
+} throttle;
+
+/* Output waiting to go to the terminal that --max-bandwidth holds frames
+   back for, in bytes. With a limit, a tenth of a second's worth if that's
+   less. */
+#define THROTTLE_BACKLOG 4096
+
+/* Nanoseconds a frame taking longer than that to draw and write must
+   have waited for the terminal */
+#define THROTTLE_BLOCKED 10000000
+
+/* The phases of the main loop, timed for --stats and the overlay */
+enum {
+    PHASE_SIGNALS,
+    PHASE_INPUT,
+    PHASE_STEP,
+    PHASE_RESIZE,
+    PHASE_DRAW,
+    PHASE_REFRESH,
+    PHASE_WAIT,
+    PHASES
+};
+
+/* Histogram buckets, see phase_bucket */
+#define PHASE_BUCKETS 320
+
+/* How long one phase of the main loop took, each time it ran */
+typedef struct phase_stats {
+    int64_t min, max, total; /* Nanoseconds */
+    unsigned long count;
+    unsigned long buckets[PHASE_BUCKETS];
+} phase_stats;
+
+/* What each kind of cell looks like in the display modes in effect, for
+   the draw kernels. With -r, the colors are left out. */
+typedef struct cell_style {
+    int head_attr;    /* White heads, and the old-style head */
+    int head_ch;      /* Glyph of the old-style head */
+    int bar_attr;     /* The old-style '|' under a head */
+    int body_attr[2]; /* The rest, for even and odd glyphs */
+} cell_style;
+
+/* First bytes of a --record file, the last one being the version */
+#define RECORD_MAGIC "CMXR\1"
 
 /* Global variables */
 int console = 0;
 int xwindow = 0;
 int lock = 0;
-cmatrix **matrix = (cmatrix **) NULL;
-int *length = NULL;  /* Length of cols in each line */
-int *spaces = NULL;  /* Spaces left to fill */
-int *updates = NULL; /* What does this do again? */
+/* The matrix is stored column-major, one array per field: even column j
+   owns the LINES + 1 consecutive cells starting at cell_index(0, j), and
+   columns[j / 2]. Odd columns are never drawn, so they get no storage at
+   all. Everything is carved out of one allocation, the arena, which
+   keeps room to spare after the screen shrinks, for when it grows again. */
+char *arena = NULL;
+int cell_rows = 0;  /* Storage per column, at least LINES + 1 cells */
+int cell_cols = 0;  /* Columns there's storage for, at least COLS */
+column *columns = NULL;
+int *cell_val = NULL;     /* Glyph, ' ' or -1 for blank, 0 and 1 for old-style heads */
+bool *cell_head = NULL;   /* White leading cell of a new-style stream */
+bool *cell_dirty = NULL;  /* Changed since it was last drawn */
+uint32_t *rand_block = NULL; /* One random number per row, for -k */
+stream *streams = NULL;   /* stream_cap for each column, with --engine sparse */
+int stream_cap = 0;
+/* randmin to highnum, then the heads, blanks and lambda */
+glyph *glyphs = NULL;
+int glyph_count = 0;
+glyph *charset = NULL; /* Glyphs loaded by --charset */
+int charset_len = 0;
+uint64_t seed_state;   /* Hands out the generator states */
+uint64_t draw_rng;     /* Generator for choices made while drawing */
+recorder rec;         /* --record */
+player play;          /* --replay */
+screen_copy shot;     /* --hash-frames */
+#ifdef USE_EXPORT
+exporter ex;          /* --export */
+#endif
+int force_redraw = 0; /* Redraw every cell on the next frame */
+int backend = BACKEND_NCURSES;
+int engine = ENGINE_DENSE;
+int simd = -1;        /* SIMD_*, -1 for the best the CPU has */
+tty_out *ttys = NULL;      /* -t, when there's more than one */
+int tty_count = 0;
+screen_group *groups = NULL; /* One for each size the ttys come in */
+int group_count = 0;
+int group_loaded = 0;     /* Group whose simulation is in the globals */
+ansi_out term_out = {-1, NULL, 0, NULL, 0, 0, -1, -1, -1, 0};
+int default_colors = 0; /* Color pairs have the default background */
+int curses_attrs = -1;  /* Attributes set in ncurses, -1 if unknown */
+int show_stats = 0;   /* Print rendering statistics on exit */
+int cells_drawn = 0;  /* Cells drawn in the current frame */
+unsigned long frames_drawn = 0;
+unsigned long long cells_drawn_total = 0;
+int cells_drawn_max = 0;
+int fps = 0;          /* Frames drawn per second, 0 for one per step */
+int threads = 1;      /* Threads stepping the simulation, 0 for one per CPU */
+unsigned long frames_missed = 0; /* Frame deadlines skipped, behind time */
+unsigned long steps_dropped = 0; /* Steps given up after a long stall */
+throttle thr;         /* --max-bandwidth */
+phase_stats phases[PHASES];
+char *phase_names[PHASES] = {
+    "signals", "input", "step", "resize", "draw", "refresh", "wait"
+};
+int64_t phase_clock = 0; /* When the phase under way started */
+int show_overlay = 0; /* Draw the phase timings over the matrix */
+int overlay_erase = 0; /* Blank the overlay when it's just been hidden */
+/* The hot loops, specialized for the display modes by select_kernels */
+cell_style style;
+void (*step_kernel)(int first, int last, uint32_t *block) = NULL;
+void (*draw_kernel)(void) = NULL;
 #ifndef _WIN32
 volatile sig_atomic_t signal_status = 0; /* Indicates a caught signal */
 #endif
+#ifdef HAVE_POLL_H
+int signal_pipe[2] = {-1, -1}; /* Written by sighandler to wake us up */
+int input_fd = -1;  /* Where keystrokes come from */
+int timer_fd = -1;  /* Fires at the next step or frame deadline */
+#endif
+
+/* Display modes, set from the command line and by keystrokes */
+int asynch = 0;
+int bold = 0;
+int oldstyle = 0;
+int update = 4;
+int mcolor = COLOR_GREEN;
+int rainbow = 0;
+int lambda = 0;
+int paused = 0;
+int classic = 0;
+int changes = 0;
+int count = 0;   /* Frame counter for asynchronous scroll, cycles 1 - 4 */
+int randmin = 0; /* Glyphs are randmin to randmin + randnum - 1 */
+int randnum = 0;
+int highnum = 0;
+char *msg = "";
+message_box msgbox;
+
+/* Settings for --benchmark and --hash-frames */
+int bench_lines = 50;
+int bench_cols = 200;
+int bench_frames = 1000;
+unsigned int seed = 0;
+int seeded = 0;
+
+/* Columns are handed to the step threads in chunks of this many, so no
+   two threads write to the same cache line of columns[] */
+#define CHUNK_COLS 32
+
+/* With --charset, cells hold glyph numbers counting up from here, past
+   the end of Unicode, so they can't be mistaken for a blank or a head */
+#define CHARSET_BASE 0x110000
+
+/* The update and draw kernels are written once, with the display modes
+   as arguments, and inlined into a copy for each combination of them */
+#ifdef __GNUC__
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE static inline
+#endif
+
+/* Most steps taken at once to catch up with the clock */
+#define MAX_CATCHUP 10
+
+/* How often to ask -t terminals their size, in nanoseconds, and to see
+   whether the --message-file changed. Only the controlling terminal
+   sends SIGWINCH. */
+#define POLL_NS 500000000
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
 
 int va_system(char *str, ...) {
 
@@ -104,6 +491,108 @@ int va_system(char *str, ...) {
     return system(buf);
 }
 
+/* The histogram bucket of a time of t ns. Below 16 ns that's t, after
+   that there are eight buckets to each doubling, so percentiles come out
+   within an eighth or so. */
+int phase_bucket(int64_t t) {
+    int shift = 0;
+
+    if (t < 16) {
+        return t < 0 ? 0 : t;
+    }
+    while ((t >> shift) >= 16) {
+        shift++;
+    }
+    if (shift * 8 + (t >> shift) >= PHASE_BUCKETS) {
+        return PHASE_BUCKETS - 1;
+    }
+    return shift * 8 + (t >> shift);
+}
+
+/* Count a time of t ns in p */
+void phase_add(phase_stats *p, int64_t t) {
+    if (p->count == 0 || t < p->min) {
+        p->min = t;
+    }
+    if (t > p->max) {
+        p->max = t;
+    }
+    p->total += t;
+    p->count++;
+    p->buckets[phase_bucket(t)]++;
+}
+
+/* The time that pct percent of the times in p were within, at most */
+int64_t phase_percentile(phase_stats *p, double pct) {
+    unsigned long want = (unsigned long) (p->count * pct / 100 + 0.999999);
+    unsigned long seen = 0;
+    int b, shift;
+    int64_t top;
+
+    for (b = 0; b < PHASE_BUCKETS; b++) {
+        seen += p->buckets[b];
+        if (seen >= want && seen > 0) {
+            break;
+        }
+    }
+    if (b < 16) {
+        return b;
+    }
+    /* The top of the bucket */
+    shift = b / 8 - 1;
+    top = ((int64_t) (b % 8 + 9) << shift) - 1;
+    return top < p->max ? top : p->max;
+}
+
+/* Frames drawn per second since the first was due, for --max-bandwidth */
+double throttle_fps(void) {
+    if (thr.last <= thr.start) {
+        return 0;
+    }
+    return frames_drawn * 1e9 / (thr.last - thr.start);
+}
+
+/* Print what the damage tracking saved us, for --stats */
+void print_stats(void) {
+    int i;
+
+    printf(" CMatrix statistics:\n");
+    printf("  frames drawn: %lu\n", frames_drawn);
+    if (frames_drawn > 0) {
+        printf("  cells drawn per frame: %.1f avg, %d max (%d cells on screen)\n",
+               (double) cells_drawn_total / frames_drawn, cells_drawn_max,
+               LINES * ((COLS + 1) / 2));
+        if (backend == BACKEND_ANSI) {
+            printf("  bytes written per frame: %.1f avg\n",
+                   (double) term_out.written / frames_drawn);
+        }
+    }
+    printf("  frame deadlines missed: %lu\n", frames_missed);
+    printf("  steps dropped: %lu\n", steps_dropped);
+    if (thr.on) {
+        printf("  frames held back for --max-bandwidth: %lu, cut short: %lu\n",
+               thr.held, thr.capped);
+        printf("  frame rate achieved: %.1f/s\n", throttle_fps());
+    }
+    printf("  time per main loop phase (us):\n");
+    printf("   %-8s %10s %10s %10s %10s %10s\n", "phase", "count", "min",
+           "avg", "p99", "max");
+    for (i = 0; i < PHASES; i++) {
+        if (phases[i].count == 0) {
+            continue;
+        }
+        printf("   %-8s %10lu %10.1f %10.1f %10.1f %10.1f\n", phase_names[i],
+               phases[i].count, phases[i].min / 1e3,
+               (double) phases[i].total / phases[i].count / 1e3,
+               phase_percentile(&phases[i], 99) / 1e3, phases[i].max / 1e3);
+    }
+#ifdef USE_EXPORT
+    if (ex.out != NULL) {
+        printf("  frames dropped from the export: %lu\n", ex.dropped);
+    }
+#endif
+}
+
 /* What we do when we're all set to exit */
 void finish(void) {
     curs_set(1);
@@ -118,6 +607,9 @@ void finish(void) {
         va_system("setfont");
 #endif
     }
+    if (show_stats) {
+        print_stats();
+    }
     exit(0);
 }
 
@@ -140,206 +632,3476 @@ void c_die(char *msg, ...) {
 #endif
     }
 
-    va_start(ap, msg);
-    vfprintf(stderr, msg, ap);
-    va_end(ap);
-    exit(0);
+    va_start(ap, msg);
+    vfprintf(stderr, msg, ap);
+    va_end(ap);
+    exit(0);
+}
+
+void usage(void) {
+    printf(" Usage: cmatrix -[abBcfhlsmVxk] [-u delay] [-C color] [-t tty] [-M message]\n");
+    printf(" -a: Asynchronous scroll\n");
+    printf(" -b: Bold characters on\n");
+    printf(" -B: All bold characters (overrides -b)\n");
+    printf(" -c: Use Japanese characters as seen in the original matrix. Requires appropriate fonts\n");
+    printf(" -f: Force the linux $TERM type to be on\n");
+    printf(" -l: Linux mode (uses matrix console font)\n");
+    printf(" -L: Lock mode (can be closed from another terminal)\n");
+    printf(" -o: Use old-style scrolling\n");
+    printf(" -h: Print usage and exit\n");
+    printf(" -n: No bold characters (overrides -b and -B, default)\n");
+    printf(" -s: \"Screensaver\" mode, exits on first keystroke\n");
+    printf(" -x: X window mode, use if your xterm is using mtx.pcf\n");
+    printf(" -V: Print version information and exit\n");
+    printf(" -M [message]: Prints your message in the center of the screen. Overrides -L's default message.\n");
+    printf(" --message-file [file]: Show the text in this file as the message, and\n"
+           "   again whenever it changes\n");
+    printf(" -u delay (0 - 10, default 4): Screen update delay\n");
+    printf(" -C [color]: Use this color for matrix (default green)\n");
+    printf(" -r: rainbow mode\n");
+    printf(" -m: lambda mode\n");
+    printf(" -k: Characters change while scrolling. (Works without -o opt.)\n");
+    printf(" -t [tty]: Set tty to use. Give it more than once, or a file listing\n"
+           "   ttys, to draw on them all\n");
+    printf(" --stats: Print rendering statistics and main loop timings on exit\n"
+           "   (press i to see the timings while running)\n");
+    printf(" --seed [number]: Seed the random number generator\n");
+    printf(" --fps [number]: Frames drawn per second, independent of -u\n"
+           "   (default one frame per update)\n");
+    printf(" --charset [file]: Draw the characters in this UTF-8 file instead\n");
+    printf(" --threads [number]: Threads stepping the animation, for very wide\n"
+           "   screens (default 1, 0 for one per CPU)\n");
+    printf(" --backend [ncurses|ansi]: Draw with ncurses (default) or write ANSI\n"
+           "   escape sequences directly, one write per frame\n");
+    printf(" --max-bandwidth [bytes]: Hold output to this many bytes per second\n"
+           "   (k and M suffixes, 0 for no limit), and back off while the terminal\n"
+           "   is behind (uses the ansi backend)\n");
+    printf(" --engine [dense|sparse]: Step the streams by scanning every cell\n"
+           "   (default) or by tracking where each one starts and ends\n");
+    printf(" --simd [auto|avx2|sse2|none]: Vector instructions for the dense\n"
+           "   engine (default: the best the CPU has)\n");
+    printf(" --record [file]: Record the frames drawn to this file\n");
+    printf(" --replay [file]: Play back a recording and exit\n");
+    printf(" --export [file]: Also write the output to this file, as an asciicast\n"
+           "   if it ends in .cast (uses the ansi backend)\n");
+    printf(" --speed [number]: Play back this many times as fast (default 1, 0 for\n"
+           "   no delay)\n");
+    printf(" --benchmark: Time each scroll mode and backend without a terminal and exit\n"
+           "   (or drawing the --replay file)\n");
+    printf(" --hash-frames: Run without a terminal and print a hash of the screen\n"
+           "   after each frame, for the golden tests\n");
+    printf(" --lines [number], --cols [number], --frames [number]: Screen size and\n"
+           "   length of each --benchmark or --hash-frames run (default 50 x 200,\n"
+           "   1000 frames)\n");
+}
+
+void version(void) {
+    printf(" CMatrix version %s (compiled %s, %s)\n",
+        VERSION, __TIME__, __DATE__);
+    printf("Email: abishekvashok@gmail.com\n");
+    printf("Web: https://github.com/abishekvashok/cmatrix\n");
+}
+
+
+/* nmalloc from nano by Big Gaute */
+void *nmalloc(size_t howmuch) {
+    void *r;
+
+    if (!(r = malloc(howmuch))) {
+        c_die("CMatrix: malloc: out of memory!");
+    }
+
+    return r;
+}
+
+/* The random number generators are xorshift64*, one per column so each
+   column's sequence doesn't depend on the others and a --seed always
+   replays the same animation. Their states come from splitmix64. */
+uint64_t next_seed(void) {
+    uint64_t z = (seed_state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    /* xorshift gets stuck on 0 */
+    return z ? z : 0x9e3779b97f4a7c15ULL;
+}
+
+void seed_rng(unsigned int s) {
+    seed_state = s;
+    draw_rng = next_seed();
+}
+
+static inline uint32_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (x * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/* A random number from 0 to n - 1. Multiplying and shifting instead of
+   taking a modulo avoids a division, and its bias is below 2^-32 * n. */
+static inline int rng_range(uint64_t *state, int n) {
+    return ((uint64_t) rng_next(state) * n) >> 32;
+}
+
+/* A random glyph, using the upper 29 bits of a random number r */
+static inline int rand_glyph(uint32_t r) {
+    return randmin + (int) (((uint64_t) (r >> 3) * randnum) >> 29);
+}
+
+/* Position of row i of column j in the cell_* arrays */
+int cell_index(int i, int j) {
+    return (j / 2) * cell_rows + i;
+}
+
+/* Store a new value in cell k, flagging it for redraw if it changed */
+void set_cell(int k, int val) {
+    if (cell_val[k] != val) {
+        cell_val[k] = val;
+        cell_dirty[k] = true;
+    }
+}
+
+/* Same as set_cell() for the head flag */
+void set_head(int k, bool is_head) {
+    if (cell_head[k] != is_head) {
+        cell_head[k] = is_head;
+        cell_dirty[k] = true;
+    }
+}
+
+/* Storage row holding screen row i of column j. Old-style columns are
+   ring buffers rotated by their offset, so scrolling never moves cells;
+   new-style columns always have an offset of 0. */
+int ring_row(int i, int j) {
+    i += columns[j / 2].offset;
+    return i > LINES ? i - (LINES + 1) : i;
+}
+
+/* Nanoseconds on the monotonic clock */
+int64_t clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Count the time since the last mark against phase p of the main loop.
+   The next phase starts now. */
+void phase_mark(int p) {
+    int64_t now = clock_ns();
+
+    phase_add(&phases[p], now - phase_clock);
+    phase_clock = now;
+}
+
+/* Whether --max-bandwidth lets a frame go out now. Not while the output
+   of the ones before is still waiting for the terminal (serial lines can
+   tell; ptys always say nothing is), or the rate is used up; then the
+   cells that changed stay dirty and go out with a later frame, so
+   nothing's lost, the frame rate just drops. */
+int throttle_frame(int64_t now) {
+    int queued = 0;
+    double backlog = THROTTLE_BACKLOG;
+
+    if (thr.start == 0) {
+        thr.start = thr.last = now;
+        thr.rate = thr.limit;
+    }
+    if (thr.rate > 0) {
+        thr.budget += thr.rate * (now - thr.last) / 1e9;
+        /* Saving up for longer would let bursts through */
+        if (thr.budget > thr.rate / 4) {
+            thr.budget = thr.rate / 4;
+        }
+        if (backlog > thr.rate / 10) {
+            backlog = thr.rate / 10;
+        }
+    }
+    thr.last = now;
+
+#ifdef TIOCOUTQ
+    if (ioctl(term_out.fd, TIOCOUTQ, &queued) == -1) {
+        queued = 0;
+    }
+#endif
+    if (queued > backlog || (thr.rate > 0 && thr.budget <= 0)) {
+        thr.held++;
+        return 0;
+    }
+    return 1;
+}
+
+/* Go by how long a frame of bytes took to draw and write, ns. When the
+   write had to wait, the terminal takes output in slower than it comes,
+   so go a little under the rate it got through at and let the backlog
+   drain. Otherwise speed up again, up to the --max-bandwidth limit. */
+void throttle_sent(int64_t ns, double bytes) {
+    double rate;
+
+    thr.budget -= bytes;
+    if (bytes == 0) {
+        return;
+    }
+    if (ns > THROTTLE_BLOCKED) {
+        rate = bytes * 1e9 / ns * 0.9;
+        if (thr.rate == 0 || rate < thr.rate) {
+            thr.rate = rate;
+        }
+    } else if (thr.rate > 0) {
+        thr.rate += thr.rate / 8;
+        if (thr.limit > 0 && thr.rate > thr.limit) {
+            thr.rate = thr.limit;
+        }
+    }
+}
+
+#ifdef USE_EXPORT
+/* Copy n bytes from src into the --export ring at pos, wrapping around */
+void export_copy_in(size_t pos, const void *src, size_t n) {
+    size_t at = pos & (EXPORT_RING - 1);
+    size_t first = (n < EXPORT_RING - at) ? n : EXPORT_RING - at;
+
+    memcpy(ex.ring + at, src, first);
+    memcpy(ex.ring, (const char *) src + first, n - first);
+}
+
+/* Copy n bytes out of the --export ring at pos into dst */
+void export_copy_out(size_t pos, void *dst, size_t n) {
+    size_t at = pos & (EXPORT_RING - 1);
+    size_t first = (n < EXPORT_RING - at) ? n : EXPORT_RING - at;
+
+    memcpy(dst, ex.ring + at, first);
+    memcpy((char *) dst + first, ex.ring, n - first);
+}
+
+/* Hand n bytes of output to the writer thread. This never waits for it:
+   when the ring is full they're dropped, and the next frame is drawn
+   whole so the export doesn't stay wrong. That frame can't count on the
+   cursor or attributes these bytes left either, as the export never
+   saw them. */
+void export_push(const char *s, size_t n) {
+    export_chunk c;
+    size_t head = atomic_load_explicit(&ex.head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ex.tail, memory_order_acquire);
+
+    if (sizeof(c) + n > EXPORT_RING - (head - tail)) {
+        ex.dropped++;
+        force_redraw = 1;
+        term_out.attr = term_out.row = term_out.col = -1;
+        return;
+    }
+    c.time = clock_ns() - ex.start;
+    c.lines = LINES;
+    c.cols = COLS;
+    c.len = n;
+    export_copy_in(head, &c, sizeof(c));
+    export_copy_in(head + sizeof(c), s, n);
+    atomic_store_explicit(&ex.head, head + sizeof(c) + n,
+                          memory_order_release);
+}
+
+/* Write a chunk of output as asciicast v2: a header line before the
+   first, then an event of the time and the bytes as a JSON string, and
+   one for every change of screen size */
+void export_cast(export_chunk *c, unsigned char *data) {
+    size_t i;
+
+    if (ex.lines == 0) {
+        fprintf(ex.out, "{\"version\": 2, \"width\": %d, \"height\": %d, "
+                "\"timestamp\": %ld}\n", c->cols, c->lines, (long) ex.started);
+    } else if (c->lines != ex.lines || c->cols != ex.cols) {
+        fprintf(ex.out, "[%.6f, \"r\", \"%dx%d\"]\n", c->time / 1e9,
+                c->cols, c->lines);
+    }
+    ex.lines = c->lines;
+    ex.cols = c->cols;
+
+    fprintf(ex.out, "[%.6f, \"o\", \"", c->time / 1e9);
+    for (i = 0; i < c->len; i++) {
+        if (data[i] == '"' || data[i] == '\\') {
+            putc('\\', ex.out);
+            putc(data[i], ex.out);
+        } else if (data[i] < 0x20 || data[i] == 0x7f) {
+            fprintf(ex.out, "\\u%04x", data[i]);
+        } else {
+            putc(data[i], ex.out);
+        }
+    }
+    fputs("\"]\n", ex.out);
+}
+
+/* The --export writer thread. Every 10 ms it writes out whatever is in
+   the ring, all in one go. */
+void *export_main(void *arg) {
+    struct timespec nap = {0, 10000000};
+    export_chunk c;
+    size_t head, tail = 0;
+    int done;
+
+    (void) arg;
+    do {
+        /* Whatever was put in before done was set is in by now */
+        done = atomic_load_explicit(&ex.done, memory_order_acquire);
+        head = atomic_load_explicit(&ex.head, memory_order_acquire);
+        while (tail != head) {
+            export_copy_out(tail, &c, sizeof(c));
+            export_copy_out(tail + sizeof(c), ex.scratch, c.len);
+            tail += sizeof(c) + c.len;
+            atomic_store_explicit(&ex.tail, tail, memory_order_release);
+
+            if (ex.cast) {
+                export_cast(&c, ex.scratch);
+            } else {
+                fwrite(ex.scratch, 1, c.len, ex.out);
+            }
+        }
+        fflush(ex.out);
+        if (!done) {
+            nanosleep(&nap, NULL);
+        }
+    } while (!done);
+    return NULL;
+}
+
+/* Finish writing the export, at exit */
+void export_stop(void) {
+    atomic_store_explicit(&ex.done, 1, memory_order_release);
+    pthread_join(ex.thread, NULL);
+    if (ferror(ex.out) || fclose(ex.out) != 0) {
+        fprintf(stderr, " Unable to write %s.\n", ex.path);
+    }
+}
+
+/* Start exporting the output to path: as an asciicast if it ends in
+   .cast, as it is otherwise */
+void export_open(char *path) {
+    size_t n = strlen(path);
+
+    ex.out = fopen(path, "wb");
+    if (ex.out == NULL) {
+        c_die(" Unable to open %s: %s.\n", path, strerror(errno));
+    }
+    setvbuf(ex.out, NULL, _IOFBF, 1 << 16);
+    ex.path = path;
+    ex.cast = (n >= 5 && strcmp(path + n - 5, ".cast") == 0);
+    ex.ring = nmalloc(EXPORT_RING);
+    ex.scratch = nmalloc(EXPORT_RING);
+    ex.start = clock_ns();
+    ex.started = time(NULL);
+    if (pthread_create(&ex.thread, NULL, export_main, NULL) != 0) {
+        c_die(" Unable to start the --export thread.\n");
+    }
+    atexit(export_stop);
+
+    /* Start off with a clear screen, like the terminal has */
+    export_push("\033[H\033[2J", 7);
+}
+#endif
+
+/* Write all len bytes of buf to fd, unless it fails. Returns how many
+   went out. */
+size_t write_fully(int fd, const char *buf, size_t len) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = write(fd, buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Write out the ANSI frame buffer */
+void ansi_flush(ansi_out *o) {
+    int i;
+
+#ifdef USE_EXPORT
+    if (ex.out != NULL && o->len > 0) {
+        export_push(o->buf, o->len);
+    }
+#endif
+
+    o->written += write_fully(o->fd, o->buf, o->len);
+    for (i = 0; i < o->nmore; i++) {
+        o->written += write_fully(o->more[i], o->buf, o->len);
+    }
+    o->len = 0;
+}
+
+/* Append n bytes to the ANSI frame buffer */
+void ansi_put(ansi_out *o, const char *s, size_t n) {
+    if (o->len + n > o->size) {
+        ansi_flush(o);
+    }
+    memcpy(o->buf + o->len, s, n);
+    o->len += n;
+}
+
+/* Size the ANSI frame buffer for the screen so a frame never has to be
+   flushed halfway. A cell takes at most a cursor move, an SGR sequence
+   and a four byte glyph. */
+void ansi_init(ansi_out *o, int fd) {
+    size_t size = (size_t) LINES * COLS * 32 + 256;
+
+    if (o->buf == NULL || o->size < size) {
+        free(o->buf);
+        o->buf = nmalloc(size);
+        o->size = size;
+    }
+    o->fd = fd;
+    o->len = 0;
+    o->row = o->col = -1;
+    o->attr = -1;
+}
+
+/* Encode code point ch as UTF-8 into out, returning the length */
+int utf8_encode(int ch, char *out) {
+    if (ch < 0x80) {
+        out[0] = ch;
+        return 1;
+    } else if (ch < 0x800) {
+        out[0] = 0xc0 | (ch >> 6);
+        out[1] = 0x80 | (ch & 0x3f);
+        return 2;
+    } else if (ch < 0x10000) {
+        out[0] = 0xe0 | (ch >> 12);
+        out[1] = 0x80 | ((ch >> 6) & 0x3f);
+        out[2] = 0x80 | (ch & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (ch >> 18);
+    out[1] = 0x80 | ((ch >> 12) & 0x3f);
+    out[2] = 0x80 | ((ch >> 6) & 0x3f);
+    out[3] = 0x80 | (ch & 0x3f);
+    return 4;
+}
+
+/* Decode the UTF-8 character at p, which ends before end, into ch.
+   Returns its length, or 0 if it isn't valid UTF-8. */
+int utf8_decode(const unsigned char *p, const unsigned char *end, int *ch) {
+    int len, i;
+
+    if (p[0] < 0x80) {
+        *ch = p[0];
+        return 1;
+    } else if (p[0] >= 0xc2 && p[0] < 0xe0) {
+        len = 2;
+        *ch = p[0] & 0x1f;
+    } else if (p[0] >= 0xe0 && p[0] < 0xf0) {
+        len = 3;
+        *ch = p[0] & 0x0f;
+    } else if (p[0] >= 0xf0 && p[0] < 0xf5) {
+        len = 4;
+        *ch = p[0] & 0x07;
+    } else {
+        return 0;
+    }
+    if (end - p < len) {
+        return 0;
+    }
+    for (i = 1; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        *ch = (*ch << 6) | (p[i] & 0x3f);
+    }
+    /* No overlong forms, surrogates or code points past Unicode */
+    if ((len == 3 && *ch < 0x800) || (len == 4 && *ch < 0x10000)
+        || (*ch >= 0xd800 && *ch < 0xe000) || *ch > 0x10ffff) {
+        return 0;
+    }
+    return len;
+}
+
+/* Write n in decimal at p, returning the length. This runs for every
+   cell, and is a lot cheaper than sprintf(). */
+int ansi_number(char *p, int n) {
+    char digits[12];
+    int len = 0, i;
+
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    for (i = 0; i < len; i++) {
+        p[i] = digits[len - 1 - i];
+    }
+    return len;
+}
+
+/* Move the cursor, unless it's already there. Skipping ahead on the same
+   line is a relative move, which is shorter than an absolute one. */
+void ansi_move(ansi_out *o, int row, int col) {
+    char seq[32];
+    int len = 2;
+
+    if (o->row == row && o->col == col) {
+        return;
+    }
+    seq[0] = '\033';
+    seq[1] = '[';
+    if (o->row == row && o->col != -1 && col > o->col && col < COLS) {
+        if (col - o->col > 1) {
+            len += ansi_number(seq + len, col - o->col);
+        }
+        seq[len++] = 'C';
+    } else {
+        len += ansi_number(seq + len, row + 1);
+        seq[len++] = ';';
+        len += ansi_number(seq + len, col + 1);
+        seq[len++] = 'H';
+    }
+    ansi_put(o, seq, len);
+    o->row = row;
+    o->col = col;
+}
+
+/* Scroll the whole screen down a line, leaving a blank top line */
+void ansi_scroll_down(ansi_out *o) {
+    ansi_move(o, 0, 0);
+    /* Reverse index on the top line scrolls down */
+    ansi_put(o, "\033M", 2);
+}
+
+/* Switch to attributes attr, sending only the parts that differ from the
+   ones in effect. Pair 0 is the terminal's default colors, like it is in
+   ncurses. Altcharset has no ANSI equivalent and is left out. */
+void ansi_attr(ansi_out *o, int attr) {
+    char seq[32];
+    int len = 2;
+    int old = o->attr;
+    int color = attr & ATTR_COLOR;
+
+    if (old == attr) {
+        return;
+    }
+    seq[0] = '\033';
+    seq[1] = '[';
+    if (old == -1) {
+        /* Start from a known state: default colors, not bold */
+        seq[len++] = '0';
+        old = 0;
+    }
+    if ((old & ATTR_COLOR) != color) {
+        if (len > 2) {
+            seq[len++] = ';';
+        }
+        if (color == 0) {
+            memcpy(seq + len, "39;49", 5);
+            len += default_colors ? 2 : 5;
+        } else {
+            seq[len++] = '3';
+            seq[len++] = '0' + color;
+            if (!default_colors && (old & ATTR_COLOR) == 0) {
+                memcpy(seq + len, ";40", 3);
+                len += 3;
+            }
+        }
+    }
+    if ((old ^ attr) & ATTR_BOLD) {
+        if (len > 2) {
+            seq[len++] = ';';
+        }
+        if (attr & ATTR_BOLD) {
+            seq[len++] = '1';
+        } else {
+            memcpy(seq + len, "22", 2);
+            len += 2;
+        }
+    }
+    if (len > 2) {
+        seq[len++] = 'm';
+        ansi_put(o, seq, len);
+    }
+    o->attr = attr;
+}
+
+void ansi_cell(ansi_out *o, int row, int col, glyph *g, int attr) {
+    ansi_move(o, row, col);
+    ansi_attr(o, attr);
+    ansi_put(o, g->utf8, g->len);
+    o->col++;
+}
+
+/* Whether a blank drawn with attributes a looks the same as one drawn
+   with attributes b. Only the background shows, and that's the same for
+   every pair except 0 unless the terminal has default colors. */
+int same_blank(int a, int b) {
+    return default_colors || ((a & ATTR_COLOR) == 0) == ((b & ATTR_COLOR) == 0);
+}
+
+/* Switch the ncurses attributes, if they differ from the current ones */
+void curses_attr(int attr) {
+    attr_t a;
+
+    if (attr == curses_attrs) {
+        return;
+    }
+    a = COLOR_PAIR(attr & ATTR_COLOR);
+    if (attr & ATTR_BOLD) {
+        a |= A_BOLD;
+    }
+    if (attr & ATTR_ALTCHARSET) {
+        a |= A_ALTCHARSET;
+    }
+    attrset(a);
+    curses_attrs = attr;
+}
+
+/* Encode ch into g */
+void make_glyph(glyph *g, int ch) {
+    wchar_t wstr[2];
+
+    g->ch = ch;
+    g->len = utf8_encode(ch, g->utf8);
+    wstr[0] = ch;
+    wstr[1] = 0;
+    setcchar(&g->cc, wstr, A_NORMAL, 0, NULL);
+}
+
+/* The glyph table entry for ch. Everything the matrix draws is in it. */
+glyph *find_glyph(int ch) {
+    int i;
+
+    if (ch >= randmin && ch <= highnum) {
+        return &glyphs[ch - randmin];
+    }
+    for (i = highnum - randmin + 1; i < glyph_count; i++) {
+        if (glyphs[i].ch == ch) {
+            return &glyphs[i];
+        }
+    }
+    return NULL;
+}
+
+/* Write v at p as a varint, seven bits a byte from the low end, the top
+   bit set on all but the last. Returns how many bytes that took, at most
+   10. */
+int varint_encode(uint64_t v, unsigned char *p) {
+    int n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+/* Fold the sign into the low bit, so small negative numbers make small
+   varints too */
+uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+/* Append a varint to the cells of the frame being recorded */
+void record_varint(uint64_t v) {
+    unsigned char *buf;
+
+    if (rec.len + 10 > rec.size) {
+        rec.size *= 2;
+        buf = nmalloc(rec.size);
+        memcpy(buf, rec.buf, rec.len);
+        free(rec.buf);
+        rec.buf = buf;
+    }
+    rec.len += varint_encode(v, rec.buf + rec.len);
+}
+
+/* Write out the cells held back. Each goes out as its position's distance
+   from just past the last cell's, zigzagged and shifted left for two
+   flags: 1 if its attributes follow, 2 if it's a run of run_count cells
+   run_step apart, the count and step following. Then comes the glyph.
+   Positions count row by row; a frame starts at -1 with attributes 0. */
+void record_run(void) {
+    int flags = 0;
+
+    if (rec.run_count == 0) {
+        return;
+    }
+    if (rec.run_attr != rec.attr) {
+        flags |= 1;
+    }
+    if (rec.run_count > 1) {
+        flags |= 2;
+    }
+    record_varint(zigzag(rec.run_pos - (rec.pos + 1)) << 2 | flags);
+    if (flags & 1) {
+        record_varint(rec.run_attr);
+    }
+    if (flags & 2) {
+        record_varint(rec.run_count);
+        record_varint(rec.run_step);
+    }
+    record_varint(rec.run_ch);
+    rec.pos = rec.run_pos + (rec.run_count - 1) * rec.run_step;
+    rec.attr = rec.run_attr;
+    rec.run_count = 0;
+}
+
+/* Record code point ch drawn with attributes attr at row, col. Cells the
+   same as the ones before them, at the same distance, pile up into a run:
+   blank rows after a redraw, the message box. */
+void record_cell(int row, int col, int ch, int attr) {
+    int pos = row * rec.cols + col;
+
+    if (row < 0 || row >= rec.lines || col < 0 || col >= rec.cols) {
+        return;
+    }
+    if (rec.run_count > 0 && ch == rec.run_ch && attr == rec.run_attr) {
+        if (rec.run_count == 1 && pos > rec.run_pos) {
+            rec.run_step = pos - rec.run_pos;
+            rec.run_count++;
+            return;
+        }
+        if (pos == rec.run_pos + rec.run_count * rec.run_step) {
+            rec.run_count++;
+            return;
+        }
+    }
+    record_run();
+    rec.run_pos = pos;
+    rec.run_count = 1;
+    rec.run_ch = ch;
+    rec.run_attr = attr;
+}
+
+/* Start recording to path */
+void record_open(char *path) {
+    rec.out = fopen(path, "wb");
+    if (rec.out == NULL) {
+        c_die(" Unable to open %s: %s.\n", path, strerror(errno));
+    }
+    /* Frames go out in big writes, not one for each */
+    setvbuf(rec.out, NULL, _IOFBF, 1 << 16);
+    fputs(RECORD_MAGIC, rec.out);
+    rec.size = 4096;
+    rec.buf = nmalloc(rec.size);
+    rec.pos = -1;
+}
+
+/* Positions in the frame about to be drawn count at the current size */
+void record_start(void) {
+    if (LINES != rec.lines || COLS != rec.cols) {
+        rec.lines = LINES;
+        rec.cols = COLS;
+        rec.resized = 1;
+    }
+}
+
+/* Write out the frame drawn since record_start */
+void record_frame(void) {
+    unsigned char head[50];
+    int64_t now = clock_ns();
+    size_t n;
+
+    record_run();
+    if (rec.last == 0) {
+        rec.last = now;
+    }
+    n = varint_encode((now - rec.last) / 1000, head);
+    /* Count from the microsecond written, so rounding doesn't add up */
+    rec.last += (now - rec.last) / 1000 * 1000;
+    n += varint_encode(rec.resized, head + n);
+    if (rec.resized) {
+        n += varint_encode(rec.lines, head + n);
+        n += varint_encode(rec.cols, head + n);
+    }
+    n += varint_encode(rec.len, head + n);
+    if (fwrite(head, 1, n, rec.out) != n
+        || fwrite(rec.buf, 1, rec.len, rec.out) != rec.len) {
+        c_die(" Unable to write the recording: %s.\n", strerror(errno));
+    }
+    rec.len = 0;
+    rec.pos = -1;
+    rec.attr = 0;
+    rec.resized = 0;
+}
+
+/* Note code point ch drawn with attributes attr at row, col for
+   --hash-frames */
+void shot_cell(int row, int col, int ch, int attr) {
+    if (row < 0 || row >= shot.lines || col < 0 || col >= shot.cols) {
+        return;
+    }
+    shot.ch[row * shot.cols + col] = ch;
+    shot.attr[row * shot.cols + col] = attr;
+}
+
+/* Draw glyph g with attributes attr at row, col. Attributes only change
+   when they have to. */
+void put_glyph(int row, int col, glyph *g, int attr) {
+    if (backend == BACKEND_ANSI) {
+        /* A blank keeps whatever is in effect if that looks the same. Not
+           for ncurses: it diffs attributes itself, and blanks with stable
+           attributes let it spot scrolled lines. */
+        if (g->ch == ' ' && term_out.attr != -1
+            && same_blank(term_out.attr, attr)) {
+            attr = term_out.attr;
+        }
+        ansi_cell(&term_out, row, col, g, attr);
+        return;
+    }
+
+    move(row, col);
+    curses_attr(attr);
+    if (g->ch < 0x80) {
+        addch(g->ch);
+    } else {
+        /* addch doesn't work with unicode characters, but a cchar_t
+           made up front does, and saves converting each time */
+        add_wch(&g->cc);
+    }
+}
+
+/* Draw glyph ch with attributes attr at row, col */
+void put_cell(int row, int col, int ch, int attr) {
+    glyph *g = find_glyph(ch);
+    glyph other;
+
+    if (g == NULL) {
+        make_glyph(&other, ch);
+        g = &other;
+    }
+    if (rec.out != NULL) {
+        /* The code point, not ch, which is a number with --charset */
+        record_cell(row, col, g->ch, attr);
+    }
+    if (shot.ch != NULL) {
+        shot_cell(row, col, g->ch, attr);
+    }
+    put_glyph(row, col, g, attr);
+}
+
+/* Draw a string with the default attributes at row, col */
+void put_text(int row, int col, char *str) {
+    const unsigned char *p = (const unsigned char *) str;
+    const unsigned char *end = p + strlen(str);
+    int ch, len, i;
+
+    if (rec.out != NULL || shot.ch != NULL) {
+        /* Recorded a character a cell */
+        for (i = col; p < end; p += len, i++) {
+            len = utf8_decode(p, end, &ch);
+            if (len == 0) {
+                break;
+            }
+            if (rec.out != NULL) {
+                record_cell(row, i, ch, 0);
+            }
+            if (shot.ch != NULL) {
+                shot_cell(row, i, ch, 0);
+            }
+        }
+    }
+    if (backend == BACKEND_ANSI) {
+        ansi_move(&term_out, row, col);
+        ansi_attr(&term_out, 0);
+        ansi_put(&term_out, str, strlen(str));
+        /* Multibyte text leaves the cursor somewhere we can't tell */
+        term_out.col = -1;
+        return;
+    }
+    curses_attr(0);
+    mvaddstr(row, col, str);
+}
+
+/* Send the frame to the terminal */
+void flush_frame(void) {
+    if (backend == BACKEND_ANSI) {
+        ansi_flush(&term_out);
+    } else {
+        refresh();
+    }
+}
+
+/* Start column j off empty, with a generator of its own */
+void init_column(int j) {
+    int i;
+    int base = cell_index(0, j);
+    column *c = &columns[j / 2];
+
+    /* Make the matrix */
+    for (i = 0; i <= LINES; i++) {
+        cell_val[base + i] = -1;
+        cell_head[base + i] = false;
+        cell_dirty[base + i] = true;
+    }
+
+    c->rng = next_seed();
+
+    /* Set up how many spaces to skip */
+    c->spaces = rng_range(&c->rng, LINES) + 1;
+
+    /* And length of the stream */
+    c->length = rng_range(&c->rng, LINES - 3) + 3;
+
+    /* Sentinel value for creation of new objects */
+    cell_val[base + 1] = ' ';
+
+    /* And set the update speed */
+    c->updates = rng_range(&c->rng, 3) + 1;
+
+    c->offset = 0;
+    c->scrolled = 0;
+    c->first = 0;
+    c->nstreams = 0;
+}
+
+/* Stream n from the top of column j, for the sparse engine */
+stream *column_stream(int j, int n) {
+    column *c = &columns[j / 2];
+
+    return &streams[j / 2 * stream_cap + (c->first + n) % stream_cap];
+}
+
+/* Work out the streams of new-style column j from its cells, for the
+   sparse engine to take over from there */
+void find_streams(int j) {
+    int i = 0;
+    int *col = cell_val + cell_index(0, j);
+    column *c = &columns[j / 2];
+    stream *s;
+
+    c->first = 0;
+    c->nstreams = 0;
+    while (i <= LINES) {
+        while (i <= LINES && (col[i] == ' ' || col[i] == -1)) {
+            i++;
+        }
+        if (i > LINES) {
+            break;
+        }
+        s = column_stream(j, c->nstreams++);
+        s->top = i;
+        while (i <= LINES && col[i] != ' ' && col[i] != -1) {
+            i++;
+        }
+        s->bottom = i - 1;
+    }
+}
+
+/* Round n up to whole cache lines */
+size_t cache_lines(size_t n) {
+    return (n + 63) & ~(size_t) 63;
+}
+
+/* Make a new arena with room for rows x cols and point the matrix arrays
+   into it, each on a cache line of its own. Returns the old arena, which
+   the caller copies what it needs from and frees. */
+char *arena_alloc(int rows, int cols) {
+    char *old = arena;
+    size_t cells = (size_t) (cols + 1) / 2 * rows;
+    size_t size_columns = cache_lines((cols + 1) / 2 * sizeof(column));
+    size_t size_val = cache_lines(cells * sizeof(int));
+    size_t size_flags = cache_lines(cells * sizeof(bool));
+    size_t size_block = cache_lines(rows * sizeof(uint32_t));
+    size_t size_streams = 0;
+    char *p;
+
+    /* Streams are apart by a blank cell at least, so a column never holds
+       more than half its rows' worth */
+    if (engine == ENGINE_SPARSE) {
+        stream_cap = rows / 2 + 1;
+        size_streams = cache_lines((size_t) (cols + 1) / 2 * stream_cap
+                                   * sizeof(stream));
+    }
+
+    /* malloc() only promises 16 byte alignment, so line it up ourselves */
+    arena = nmalloc(size_columns + size_val + 2 * size_flags + size_block
+                    + size_streams + 63);
+    p = (char *) cache_lines((uintptr_t) arena);
+    columns = (column *) p;
+    p += size_columns;
+    cell_val = (int *) p;
+    p += size_val;
+    cell_head = (bool *) p;
+    p += size_flags;
+    cell_dirty = (bool *) p;
+    p += size_flags;
+    rand_block = (uint32_t *) p;
+    p += size_block;
+    streams = (stream *) p;
+
+    cell_rows = rows;
+    cell_cols = cols;
+    return old;
+}
+
+/* Initialize the global variables */
+void var_init() {
+    int j;
+
+    if (cell_rows != LINES + 1 || cell_cols != COLS) {
+        free(arena_alloc(LINES + 1, COLS));
+    }
+
+    for (j = 0; j <= COLS - 1; j += 2) {
+        init_column(j);
+    }
+
+    if (backend == BACKEND_ANSI) {
+        ansi_init(&term_out, term_out.fd);
+    }
+    curses_attrs = -1;
+    /* Nothing's on the screen yet, the message box included */
+    force_redraw = 1;
+
+}
+
+/* Reverse cells first to last - 1 */
+void reverse_cells(int first, int last) {
+    int v;
+    bool f;
+
+    for (last--; first < last; first++, last--) {
+        v = cell_val[first];
+        cell_val[first] = cell_val[last];
+        cell_val[last] = v;
+        f = cell_head[first];
+        cell_head[first] = cell_head[last];
+        cell_head[last] = f;
+        f = cell_dirty[first];
+        cell_dirty[first] = cell_dirty[last];
+        cell_dirty[last] = f;
+    }
+}
+
+/* Fit the matrix to a screen that was old_lines x old_cols, keeping the
+   columns and rows that are still on it as they are. Only new columns
+   are set up from scratch. The arena grows by half again whenever it's
+   too small, so dragging a window edge doesn't reallocate at every step. */
+void resize_grid(int old_lines, int old_cols) {
+    int i, j, base, old_stride = cell_rows;
+    int old_rows = old_lines + 1;
+    int keep_cols = old_cols < COLS ? old_cols : COLS;
+    int rows = cell_rows, cols = cell_cols;
+    column *c;
+
+    if (LINES + 1 > rows) {
+        rows = rows + rows / 2 > LINES + 1 ? rows + rows / 2 : LINES + 1;
+    }
+    if (COLS > cols) {
+        cols = cols + cols / 2 > COLS ? cols + cols / 2 : COLS;
+    }
+
+    if (rows != cell_rows || cols != cell_cols) {
+        column *old_columns = columns;
+        int *old_val = cell_val;
+        bool *old_head = cell_head, *old_dirty = cell_dirty;
+        char *old = arena_alloc(rows, cols);
+
+        memcpy(columns, old_columns, (keep_cols + 1) / 2 * sizeof(column));
+        for (j = 0; j < keep_cols; j += 2) {
+            base = j / 2 * old_stride;
+            memcpy(cell_val + cell_index(0, j), old_val + base,
+                   old_rows * sizeof(int));
+            memcpy(cell_head + cell_index(0, j), old_head + base,
+                   old_rows * sizeof(bool));
+            memcpy(cell_dirty + cell_index(0, j), old_dirty + base,
+                   old_rows * sizeof(bool));
+        }
+        free(old);
+    }
+
+    for (j = 0; j < keep_cols; j += 2) {
+        base = cell_index(0, j);
+        c = &columns[j / 2];
+
+        /* The old-style ring buffer changes size, so unroll it. Rotating
+           by three reversals needs no room to spare. */
+        if (c->offset != 0) {
+            reverse_cells(base, base + c->offset);
+            reverse_cells(base + c->offset, base + old_rows);
+            reverse_cells(base, base + old_rows);
+            c->offset = 0;
+        }
+
+        /* New rows at the bottom start out blank */
+        for (i = old_rows; i <= LINES; i++) {
+            cell_val[base + i] = -1;
+            cell_head[base + i] = false;
+            cell_dirty[base + i] = true;
+        }
+
+        /* Streams may have been cut off at the bottom */
+        if (engine == ENGINE_SPARSE) {
+            find_streams(j);
+        }
+    }
+
+    for (j = (old_cols + 1) & ~1; j <= COLS - 1; j += 2) {
+        init_column(j);
+    }
+}
+
+/* Long-only options, numbered past the range of the short ones */
+enum {
+    OPT_STATS = 256,
+    OPT_SEED,
+    OPT_BENCHMARK,
+    OPT_LINES,
+    OPT_COLS,
+    OPT_FRAMES,
+    OPT_BACKEND,
+    OPT_FPS,
+    OPT_THREADS,
+    OPT_CHARSET,
+    OPT_RECORD,
+    OPT_REPLAY,
+    OPT_SPEED,
+    OPT_EXPORT,
+    OPT_ENGINE,
+    OPT_SIMD,
+    OPT_HASH_FRAMES,
+    OPT_MESSAGE_FILE,
+    OPT_MAX_BANDWIDTH
+};
+
+#ifdef HAVE_GETOPT_H
+struct option long_options[] = {
+    {"stats", no_argument, NULL, OPT_STATS},
+    {"seed", required_argument, NULL, OPT_SEED},
+    {"benchmark", no_argument, NULL, OPT_BENCHMARK},
+    {"lines", required_argument, NULL, OPT_LINES},
+    {"cols", required_argument, NULL, OPT_COLS},
+    {"frames", required_argument, NULL, OPT_FRAMES},
+    {"backend", required_argument, NULL, OPT_BACKEND},
+    {"fps", required_argument, NULL, OPT_FPS},
+    {"threads", required_argument, NULL, OPT_THREADS},
+    {"charset", required_argument, NULL, OPT_CHARSET},
+    {"record", required_argument, NULL, OPT_RECORD},
+    {"replay", required_argument, NULL, OPT_REPLAY},
+    {"speed", required_argument, NULL, OPT_SPEED},
+    {"export", required_argument, NULL, OPT_EXPORT},
+    {"engine", required_argument, NULL, OPT_ENGINE},
+    {"simd", required_argument, NULL, OPT_SIMD},
+    {"hash-frames", no_argument, NULL, OPT_HASH_FRAMES},
+    {"message-file", required_argument, NULL, OPT_MESSAGE_FILE},
+    {"max-bandwidth", required_argument, NULL, OPT_MAX_BANDWIDTH},
+    {NULL, 0, NULL, 0}
+};
+#endif
+
+#ifndef _WIN32
+void sighandler(int s) {
+    signal_status = s;
+#ifdef HAVE_POLL_H
+    if (signal_pipe[1] != -1) {
+        int saved_errno = errno;
+        ssize_t n = write(signal_pipe[1], "", 1);
+
+        (void) n; /* A full pipe will wake us up just the same */
+        errno = saved_errno;
+    }
+#endif
+}
+#endif
+
+/* Add the tty at path to the ones to draw on. A regular file is taken
+   as a list of them instead, one to a line. */
+void tty_add(char *path) {
+    struct stat st;
+    char line[4096];
+    size_t n;
+    FILE *list;
+    tty_out *old = ttys;
+
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        list = fopen(path, "r");
+        if (list == NULL) {
+            c_die(" Unable to open %s: %s.\n", path, strerror(errno));
+        }
+        while (fgets(line, sizeof(line), list) != NULL) {
+            n = strcspn(line, "\r\n");
+            line[n] = '\0';
+            if (n > 0 && line[0] != '#') {
+                tty_add(strdup(line));
+            }
+        }
+        fclose(list);
+        return;
+    }
+
+    ttys = nmalloc((tty_count + 1) * sizeof(tty_out));
+    if (old != NULL) {
+        memcpy(ttys, old, tty_count * sizeof(tty_out));
+        free(old);
+    }
+    ttys[tty_count].path = path;
+    ttys[tty_count].fd = -1;
+    ttys[tty_count].lines = ttys[tty_count].cols = -1;
+    ttys[tty_count].group = -1;
+    tty_count++;
+}
+
+/* Keep the simulation in the globals in group g */
+void group_save(screen_group *g) {
+    g->arena = arena;
+    g->cell_rows = cell_rows;
+    g->cell_cols = cell_cols;
+    g->columns = columns;
+    g->cell_val = cell_val;
+    g->cell_head = cell_head;
+    g->cell_dirty = cell_dirty;
+    g->rand_block = rand_block;
+    g->streams = streams;
+    g->stream_cap = stream_cap;
+    g->count = count;
+    g->out = term_out;
+}
+
+/* Put the simulation of group g in the globals */
+void group_load(screen_group *g) {
+    LINES = g->lines;
+    COLS = g->cols;
+    arena = g->arena;
+    cell_rows = g->cell_rows;
+    cell_cols = g->cell_cols;
+    columns = g->columns;
+    cell_val = g->cell_val;
+    cell_head = g->cell_head;
+    cell_dirty = g->cell_dirty;
+    rand_block = g->rand_block;
+    streams = g->streams;
+    stream_cap = g->stream_cap;
+    count = g->count;
+    term_out = g->out;
+}
+
+/* Switch to group n */
+void group_use(int n) {
+    if (n == group_loaded) {
+        return;
+    }
+    group_save(&groups[group_loaded]);
+    group_load(&groups[n]);
+    group_loaded = n;
+}
+
+/* Start a group for terminals of lines x cols, with a simulation of its
+   own, and switch to it. Returns its index. */
+int group_add(int lines, int cols) {
+    screen_group *g = &groups[group_count];
+
+    if (group_count > 0) {
+        group_save(&groups[group_loaded]);
+    }
+    memset(g, 0, sizeof(*g));
+    g->lines = lines;
+    g->cols = cols;
+    g->fds = nmalloc(tty_count * sizeof(int));
+    g->out.fd = -1;
+    group_load(g);
+    group_loaded = group_count++;
+    var_init();
+    return group_loaded;
+}
+
+/* Drop group n, which has no terminals left */
+void group_remove(int n) {
+    int i, last = group_count - 1;
+
+    group_use(n);
+    free(arena);
+    free(term_out.buf);
+    free(groups[n].fds);
+
+    /* The last one takes its place */
+    groups[n] = groups[last];
+    for (i = 0; i < tty_count; i++) {
+        if (ttys[i].group == last) {
+            ttys[i].group = n;
+        }
+    }
+    group_count--;
+    group_loaded = 0;
+    /* With none left, the next group_add() loads one */
+    if (group_count > 0) {
+        group_load(&groups[0]);
+    }
+}
+
+#ifndef _WIN32
+/* Ask every -t terminal its size, and move the ones that changed to the
+   group for it. The groups that gain terminals start them off with a
+   clear screen, and everything is drawn again. groups has room for one
+   group a terminal, so the ones left empty go before any are added. */
+void ttys_poll(void) {
+    struct winsize win;
+    int i, k, n, lines, cols, moved = 0;
+    screen_group *g;
+
+    for (i = 0; i < tty_count; i++) {
+        if (ioctl(ttys[i].fd, TIOCGWINSZ, &win) == -1) {
+            continue;
+        }
+        lines = win.ws_row < 10 ? 10 : win.ws_row;
+        cols = win.ws_col < 10 ? 10 : win.ws_col;
+        if (lines == ttys[i].lines && cols == ttys[i].cols) {
+            continue;
+        }
+        ttys[i].lines = lines;
+        ttys[i].cols = cols;
+        ttys[i].group = -1;
+        moved = 1;
+    }
+    if (!moved) {
+        return;
+    }
+
+    for (n = group_count - 1; n >= 0; n--) {
+        for (i = 0; i < tty_count && ttys[i].group != n; i++) {
+        }
+        if (i == tty_count) {
+            group_remove(n);
+        }
+    }
+
+    for (i = 0; i < tty_count; i++) {
+        if (ttys[i].group != -1) {
+            continue;
+        }
+        for (n = 0; n < group_count; n++) {
+            if (groups[n].lines == ttys[i].lines
+                && groups[n].cols == ttys[i].cols) {
+                break;
+            }
+        }
+        if (n == group_count) {
+            n = group_add(ttys[i].lines, ttys[i].cols);
+        }
+        ttys[i].group = n;
+        write_fully(ttys[i].fd, "\033[H\033[2J", 7);
+    }
+
+    /* Where the cursor is on the cleared terminals is anyone's guess */
+    for (n = 0; n < group_count; n++) {
+        group_use(n);
+        g = &groups[n];
+        for (i = 0, k = 0; i < tty_count; i++) {
+            if (ttys[i].group == n) {
+                g->fds[k++] = ttys[i].fd;
+            }
+        }
+        term_out.more = g->fds + 1;
+        term_out.nmore = k - 1;
+        ansi_init(&term_out, g->fds[0]);
+    }
+    force_redraw = 1;
+}
+
+/* Leave the -t terminals past the first, which is ncurses', clean */
+void ttys_close(void) {
+    int i;
+
+    for (i = 1; i < tty_count; i++) {
+        write_fully(ttys[i].fd, "\033[0m\033[H\033[2J\033[?25h", 17);
+    }
+}
+
+/* Open the -t terminals past the first, which ncurses has on fd, and
+   put each one in a group for its size */
+void ttys_open(int fd) {
+    int i;
+
+    for (i = 0; i < tty_count; i++) {
+        ttys[i].fd = i == 0 ? fd : open(ttys[i].path, O_WRONLY | O_NOCTTY);
+        if (ttys[i].fd == -1) {
+            c_die(" Unable to open %s: %s.\n", ttys[i].path, strerror(errno));
+        }
+        if (i > 0) {
+            write_fully(ttys[i].fd, "\033[?25l", 6);
+        }
+    }
+    atexit(ttys_close);
+
+    /* The simulation var_init() made is the first group's, which the
+       first terminal, ncurses' and LINES x COLS, starts off in */
+    groups = nmalloc(tty_count * sizeof(screen_group));
+    memset(&groups[0], 0, sizeof(screen_group));
+    groups[0].lines = LINES;
+    groups[0].cols = COLS;
+    groups[0].fds = nmalloc(tty_count * sizeof(int));
+    group_count = 1;
+    group_loaded = 0;
+    ttys[0].lines = LINES;
+    ttys[0].cols = COLS;
+    ttys[0].group = 0;
+    ttys_poll();
+}
+#endif
+
+/* Blank the cells in height rows from top and width columns from left
+   that are on the screen. The draw kernels only go over the even
+   columns, so whatever else was drawn on the odd ones stays otherwise. */
+void blank_cells(int top, int left, int height, int width) {
+    int i, j;
+
+    for (i = top < 0 ? 0 : top; i < top + height && i < LINES; i++) {
+        for (j = left < 0 ? 0 : left; j < left + width && j < COLS; j++) {
+            put_cell(i, j, ' ', 0);
+        }
+    }
+}
+
+/* Where a message box of height x width goes, in the middle of a lines
+   x cols screen */
+void message_rect(int height, int width, int lines, int cols,
+                  int *top, int *left) {
+    *top = lines / 2 - (height - 2 - 1) / 2 - 1;
+    *left = cols / 2 - (width - 4) / 2 - 2;
+}
+
+/* Have the next frame blank the message box before it changes or
+   moves. lines x cols is the size of the screen it's on, -1 x -1 for
+   each one being drawn. Only the first call between two frames counts,
+   as that's the box on the screen, but it may say what size that was. */
+void message_erase(int lines, int cols) {
+    if (msgbox.erase_height > 0) {
+        if (msgbox.erase_lines == -1) {
+            msgbox.erase_lines = lines;
+            msgbox.erase_cols = cols;
+        }
+        return;
+    }
+    msgbox.erase_width = msgbox.width;
+    msgbox.erase_height = msgbox.height;
+    msgbox.erase_lines = lines;
+    msgbox.erase_cols = cols;
+}
+
+void resize_screen(void) {
+    int old_lines = LINES, old_cols = COLS;
+#ifdef _WIN32
+    BOOL result;
+    HANDLE hStdHandle;
+    CONSOLE_SCREEN_BUFFER_INFO csbiInfo;
+
+    hStdHandle = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (hStdHandle == INVALID_HANDLE_VALUE)
+        return;
+    result = GetConsoleScreenBufferInfo(hStdHandle, &csbiInfo);
+    if (!result)
+        return;
+    LINES = csbiInfo.dwSize.Y;
+    COLS = csbiInfo.dwSize.X;
+#else
+    struct winsize win;
+
+    /* Each size of terminal has a simulation of its own then */
+    if (tty_count > 1) {
+        ttys_poll();
+        return;
+    }
+
+    /* Ask the terminal we draw on */
+    if (ioctl(term_out.fd, TIOCGWINSZ, &win) == -1) {
+        return;
+    }
+
+    COLS = win.ws_col;
+    LINES = win.ws_row;
+#endif
+
+    if (LINES < 10) {
+        LINES = 10;
+    }
+    if (COLS < 10) {
+        COLS = 10;
+    }
+    if (LINES == old_lines && COLS == old_cols) {
+        return;
+    }
+
+#ifdef HAVE_RESIZETERM
+    resizeterm(LINES, COLS);
+#ifdef HAVE_WRESIZE
+    if (wresize(stdscr, LINES, COLS) == ERR) {
+        c_die("Cannot resize window!");
+    }
+#endif /* HAVE_WRESIZE */
+    /* resizeterm() asks for the screen to be cleared and sent again.
+       Terminals keep what still fits, so send just the difference, unless
+       the screen lost lines: some terminals scroll up then, to keep the
+       cursor on screen, and there's no telling where things ended up. */
+    if (LINES >= old_lines) {
+        clearok(curscr, FALSE);
+    }
+#endif /* HAVE_RESIZETERM */
+
+    resize_grid(old_lines, old_cols);
+    if (backend == BACKEND_ANSI) {
+        ansi_init(&term_out, term_out.fd);
+    }
+
+    /* No clear(), which would have ncurses send the whole screen again.
+       Going over every cell is enough for it to fix up what changed; the
+       ansi backend can't tell what the terminal did with the old
+       contents, so it has to send them all. That only covers the even
+       columns, though, and the message box, which moved, is over the odd
+       ones too. A frame drawn for the old size can also have wrapped and
+       scrolled it somewhere else on the way, so with a message the
+       screen is cleared after all. The old box is still blanked, for
+       --record. */
+    if (msgbox.height > 0) {
+        if (backend == BACKEND_ANSI) {
+            ansi_put(&term_out, "\033[0m\033[2J", 8);
+        } else {
+            clear();
+        }
+        message_erase(old_lines, old_cols);
+    }
+    force_redraw = 1;
+}
+
+
+/* Set up the color pairs, if the terminal has colors */
+void init_colors(void) {
+    if (has_colors()) {
+        start_color();
+        /* Add in colors, if available */
+#ifdef HAVE_USE_DEFAULT_COLORS
+        if (use_default_colors() != ERR) {
+            default_colors = 1;
+            init_pair(COLOR_BLACK, -1, -1);
+            init_pair(COLOR_GREEN, COLOR_GREEN, -1);
+            init_pair(COLOR_WHITE, COLOR_WHITE, -1);
+            init_pair(COLOR_RED, COLOR_RED, -1);
+            init_pair(COLOR_CYAN, COLOR_CYAN, -1);
+            init_pair(COLOR_MAGENTA, COLOR_MAGENTA, -1);
+            init_pair(COLOR_BLUE, COLOR_BLUE, -1);
+            init_pair(COLOR_YELLOW, COLOR_YELLOW, -1);
+        } else {
+#else
+        { /* Hack to deal the after effects of else in HAVE_USE_DEFAULT_COLOURS */
+#endif
+            init_pair(COLOR_BLACK, COLOR_BLACK, COLOR_BLACK);
+            init_pair(COLOR_GREEN, COLOR_GREEN, COLOR_BLACK);
+            init_pair(COLOR_WHITE, COLOR_WHITE, COLOR_BLACK);
+            init_pair(COLOR_RED, COLOR_RED, COLOR_BLACK);
+            init_pair(COLOR_CYAN, COLOR_CYAN, COLOR_BLACK);
+            init_pair(COLOR_MAGENTA, COLOR_MAGENTA, COLOR_BLACK);
+            init_pair(COLOR_BLUE, COLOR_BLUE, COLOR_BLACK);
+            init_pair(COLOR_YELLOW, COLOR_YELLOW, COLOR_BLACK);
+        }
+    }
+}
+
+/* Set up values for random number generation */
+void init_glyph_range(void) {
+    int extra[] = {' ', '|', '&', 183, 0x3bb /* λ */};
+    int i;
+
+    if (charset != NULL) {
+        /* One more than there are, as randmin + randnum is never picked */
+        randmin = CHARSET_BASE;
+        highnum = CHARSET_BASE + charset_len;
+    } else if (classic) {
+        /* Half-width kana characters. In the movie they are y-axis flipped, and
+         * they appear alongside latin characters and numerals, but this is the
+         * closest we can do with a standard unicode set and a single number
+         * range */
+        randmin = 0xff66;
+        highnum = 0xff9d;
+    } else if (console || xwindow) {
+        randmin = 166;
+        highnum = 217;
+    } else {
+        randmin = 33;
+        highnum = 123;
+    }
+    randnum = highnum - randmin;
+
+    /* Encode them all now, and the other things cells can show */
+    free(glyphs);
+    glyph_count = randnum + 1 + sizeof(extra) / sizeof(extra[0]);
+    glyphs = nmalloc(glyph_count * sizeof(glyph));
+    for (i = 0; i <= randnum; i++) {
+        if (charset != NULL) {
+            glyphs[i] = charset[i % charset_len];
+        } else {
+            make_glyph(&glyphs[i], randmin + i);
+        }
+    }
+    for (; i < glyph_count; i++) {
+        make_glyph(&glyphs[i], extra[i - randnum - 1]);
+    }
+}
+
+/* Load the glyphs for --charset from a UTF-8 file. Every character in it
+   is one, except for spaces and control characters like line breaks, so
+   it can be laid out any way. Listing a glyph twice makes it come up
+   twice as often. Each has to fill exactly one column, as the backends
+   move along one column per cell. */
+void load_charset(char *path) {
+    int fd, ch, len, n;
+    struct stat st;
+    unsigned char *data, *p, *end;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        c_die(" Unable to open %s: %s.\n", path, strerror(errno));
+    }
+    if (st.st_size == 0) {
+        c_die(" %s is empty.\n", path);
+    }
+#ifdef HAVE_SYS_MMAN_H
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        c_die(" Unable to read %s: %s.\n", path, strerror(errno));
+    }
+#else
+    data = nmalloc(st.st_size);
+    if (read(fd, data, st.st_size) != st.st_size) {
+        c_die(" Unable to read %s: %s.\n", path, strerror(errno));
+    }
+#endif
+    end = data + st.st_size;
+
+    /* Count them first, then encode each one into the table */
+    for (n = 0; n < 2; n++) {
+        charset_len = 0;
+        for (p = data; p < end; p += len) {
+            len = utf8_decode(p, end, &ch);
+            if (len == 0) {
+                c_die(" %s isn't valid UTF-8 (at byte %ld).\n", path,
+                      (long) (p - data));
+            }
+            if (ch <= ' ' || (ch >= 0x7f && ch < 0xa0)) {
+                continue;
+            }
+            if (n == 0 && wcwidth(ch) != 1) {
+                c_die(" %s has U+%04X in it, which isn't one column wide"
+                      " in this locale.\n", path, ch);
+            }
+            if (charset != NULL) {
+                make_glyph(&charset[charset_len], ch);
+            }
+            charset_len++;
+        }
+        if (charset_len == 0) {
+            c_die(" %s has no characters in it.\n", path);
+        }
+        if (charset == NULL) {
+            charset = nmalloc(charset_len * sizeof(glyph));
+        }
+    }
+
+#ifdef HAVE_SYS_MMAN_H
+    munmap(data, st.st_size);
+#else
+    free(data);
+#endif
+    close(fd);
+}
+
+/* Advance old-style column j by one step of the animation */
+ALWAYS_INLINE void update_column_old(int j) {
+    int random, below;
+    int *col = cell_val + cell_index(0, j); /* This column, contiguous top to bottom */
+    int *top;
+    column *c = &columns[j / 2];
+    uint64_t *r = &c->rng;
+
+    /* I don't like old-style scrolling, yuck */
+    /* Scroll down by stepping the ring start back one slot;
+       the old bottom row becomes the new top */
+    c->offset = (c->offset == 0) ? LINES : c->offset - 1;
+    c->scrolled++;
+    top = &col[c->offset];
+    below = col[ring_row(1, j)];
+    random = rng_range(r, randnum + 8) + randmin;
+
+    if (below == 0) {
+        *top = 1;
+    } else if (below == ' ' || below == -1) {
+        if (c->spaces > 0) {
+            *top = ' ';
+            c->spaces--;
+        } else {
+
+            /* Random number to determine whether head of next column
+               of chars has a white 'head' on it. */
+
+            if (rng_range(r, 3) == 1) {
+                *top = 0;
+            } else {
+                *top = rng_range(r, randnum) + randmin;
+            }
+            c->spaces = rng_range(r, LINES) + 1;
+        }
+    } else if (random > highnum && below != 1) {
+        *top = ' ';
+    } else {
+        *top = rng_range(r, randnum) + randmin;
+    }
+}
+
+/* set_head(k, false) for the n cells from k on, eight at a time. Flags
+   are 0 or 1, so or-ing the words together or-s them all. */
+void clear_heads(int k, int n) {
+    uint64_t head, dirty;
+
+    for (; n >= 8; k += 8, n -= 8) {
+        memcpy(&head, cell_head + k, 8);
+        if (head != 0) {
+            memcpy(&dirty, cell_dirty + k, 8);
+            dirty |= head;
+            memcpy(cell_dirty + k, &dirty, 8);
+            memset(cell_head + k, 0, 8);
+        }
+    }
+    for (; n > 0; k++, n--) {
+        set_head(k, false);
+    }
+}
+
+#ifdef USE_SIMD
+/* The SIMD versions of the scans and of -k in update_column_new(). Only
+   whole vectors inside the column are loaded, the rest is done one cell
+   at a time, and they come out exactly as the scalar loops do. */
+
+/* First of cells i up to n of col that isn't blank, or n */
+__attribute__((target("sse2")))
+int skip_blanks_sse2(const int *col, int i, int n) {
+    __m128i space = _mm_set1_epi32(' '), none = _mm_set1_epi32(-1);
+    __m128i v;
+    int m;
+
+    for (; i + 4 <= n; i += 4) {
+        v = _mm_loadu_si128((const __m128i *) (col + i));
+        v = _mm_or_si128(_mm_cmpeq_epi32(v, space), _mm_cmpeq_epi32(v, none));
+        m = ~_mm_movemask_ps(_mm_castsi128_ps(v)) & 0xf;
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    while (i < n && (col[i] == ' ' || col[i] == -1)) {
+        i++;
+    }
+    return i;
+}
+
+/* First of cells i up to n of col that is blank, or n */
+__attribute__((target("sse2")))
+int skip_stream_sse2(const int *col, int i, int n) {
+    __m128i space = _mm_set1_epi32(' '), none = _mm_set1_epi32(-1);
+    __m128i v;
+    int m;
+
+    for (; i + 4 <= n; i += 4) {
+        v = _mm_loadu_si128((const __m128i *) (col + i));
+        v = _mm_or_si128(_mm_cmpeq_epi32(v, space), _mm_cmpeq_epi32(v, none));
+        m = _mm_movemask_ps(_mm_castsi128_ps(v));
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    while (i < n && col[i] != ' ' && col[i] != -1) {
+        i++;
+    }
+    return i;
+}
+
+/* -k for cells z up to e of the column at base: the ones whose random
+   number in block has its low three bits clear get rand_glyph() of it */
+__attribute__((target("sse2")))
+void change_glyphs_sse2(int base, const uint32_t *block, int z, int e) {
+    __m128i seven = _mm_set1_epi32(7), zero = _mm_setzero_si128();
+    __m128i num = _mm_set1_epi32(randnum), min = _mm_set1_epi32(randmin);
+    __m128i r, x, lo, hi, g, v, pick;
+    int *col = cell_val + base;
+    int i = z, m;
+
+    for (; i + 4 <= e; i += 4) {
+        r = _mm_loadu_si128((const __m128i *) (block + i));
+        pick = _mm_cmpeq_epi32(_mm_and_si128(r, seven), zero);
+        if (_mm_movemask_ps(_mm_castsi128_ps(pick)) == 0) {
+            continue;
+        }
+        /* (r >> 3) * randnum >> 29 in 64 bits, even and odd lanes apart */
+        x = _mm_srli_epi32(r, 3);
+        lo = _mm_srli_epi64(_mm_mul_epu32(x, num), 29);
+        hi = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), num), 29);
+        g = _mm_add_epi32(_mm_or_si128(lo, _mm_slli_epi64(hi, 32)), min);
+
+        v = _mm_loadu_si128((const __m128i *) (col + i));
+        pick = _mm_andnot_si128(_mm_cmpeq_epi32(v, g), pick);
+        m = _mm_movemask_ps(_mm_castsi128_ps(pick));
+        if (m == 0) {
+            continue;
+        }
+        v = _mm_or_si128(_mm_and_si128(pick, g), _mm_andnot_si128(pick, v));
+        _mm_storeu_si128((__m128i *) (col + i), v);
+        for (; m != 0; m &= m - 1) {
+            cell_dirty[base + i + __builtin_ctz(m)] = true;
+        }
+    }
+    for (; i < e; i++) {
+        if ((block[i] & 7) == 0) {
+            set_cell(base + i, rand_glyph(block[i]));
+        }
+    }
+}
+
+/* skip_blanks_sse2() eight cells at a time */
+__attribute__((target("avx2")))
+int skip_blanks_avx2(const int *col, int i, int n) {
+    __m256i space = _mm256_set1_epi32(' '), none = _mm256_set1_epi32(-1);
+    __m256i v;
+    int m;
+
+    for (; i + 8 <= n; i += 8) {
+        v = _mm256_loadu_si256((const __m256i *) (col + i));
+        v = _mm256_or_si256(_mm256_cmpeq_epi32(v, space),
+                            _mm256_cmpeq_epi32(v, none));
+        m = ~_mm256_movemask_ps(_mm256_castsi256_ps(v)) & 0xff;
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    while (i < n && (col[i] == ' ' || col[i] == -1)) {
+        i++;
+    }
+    return i;
+}
+
+/* skip_stream_sse2() eight cells at a time */
+__attribute__((target("avx2")))
+int skip_stream_avx2(const int *col, int i, int n) {
+    __m256i space = _mm256_set1_epi32(' '), none = _mm256_set1_epi32(-1);
+    __m256i v;
+    int m;
+
+    for (; i + 8 <= n; i += 8) {
+        v = _mm256_loadu_si256((const __m256i *) (col + i));
+        v = _mm256_or_si256(_mm256_cmpeq_epi32(v, space),
+                            _mm256_cmpeq_epi32(v, none));
+        m = _mm256_movemask_ps(_mm256_castsi256_ps(v));
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    while (i < n && col[i] != ' ' && col[i] != -1) {
+        i++;
+    }
+    return i;
+}
+
+/* change_glyphs_sse2() eight cells at a time */
+__attribute__((target("avx2")))
+void change_glyphs_avx2(int base, const uint32_t *block, int z, int e) {
+    __m256i seven = _mm256_set1_epi32(7), zero = _mm256_setzero_si256();
+    __m256i num = _mm256_set1_epi32(randnum), min = _mm256_set1_epi32(randmin);
+    __m256i r, x, lo, hi, g, v, pick;
+    int *col = cell_val + base;
+    int i = z, m;
+
+    for (; i + 8 <= e; i += 8) {
+        r = _mm256_loadu_si256((const __m256i *) (block + i));
+        pick = _mm256_cmpeq_epi32(_mm256_and_si256(r, seven), zero);
+        if (_mm256_movemask_ps(_mm256_castsi256_ps(pick)) == 0) {
+            continue;
+        }
+        x = _mm256_srli_epi32(r, 3);
+        lo = _mm256_srli_epi64(_mm256_mul_epu32(x, num), 29);
+        hi = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), num), 29);
+        g = _mm256_add_epi32(_mm256_or_si256(lo, _mm256_slli_epi64(hi, 32)), min);
+
+        v = _mm256_loadu_si256((const __m256i *) (col + i));
+        pick = _mm256_andnot_si256(_mm256_cmpeq_epi32(v, g), pick);
+        m = _mm256_movemask_ps(_mm256_castsi256_ps(pick));
+        if (m == 0) {
+            continue;
+        }
+        _mm256_storeu_si256((__m256i *) (col + i), _mm256_blendv_epi8(v, g, pick));
+        for (; m != 0; m &= m - 1) {
+            cell_dirty[base + i + __builtin_ctz(m)] = true;
+        }
+    }
+    for (; i < e; i++) {
+        if ((block[i] & 7) == 0) {
+            set_cell(base + i, rand_glyph(block[i]));
+        }
+    }
+}
+#endif
+
+/* Advance new-style column j by one step of the animation. block is
+   scratch space for LINES + 1 random numbers. With changes (-k), the
+   glyphs change as they fall. simd picks how streams are found and -k
+   changes them, see above. */
+ALWAYS_INLINE void update_column_new(int j, uint32_t *block, int changes,
+                                     int simd) {
+    int i, y, z, firstcoldone;
+    int base = cell_index(0, j);
+    int *col = cell_val + base; /* This column, contiguous top to bottom */
+    column *c = &columns[j / 2];
+    uint64_t *r = &c->rng;
+
+    if (col[0] == -1 && col[1] == ' ' && c->spaces > 0) {
+        c->spaces--;
+    } else if (col[0] == -1 && col[1] == ' ') {
+        c->length = rng_range(r, LINES - 3) + 3;
+        set_cell(base, rng_range(r, randnum) + randmin);
+
+        c->spaces = rng_range(r, LINES) + 1;
+    }
+    /* Random numbers for the glyphs -k changes, drawn for the
+       whole column at once */
+    if (changes) {
+        for (i = 0; i <= LINES; i++) {
+            block[i] = rng_next(r);
+        }
+    }
+
+    i = 0;
+    y = 0;
+    firstcoldone = 0;
+    while (i <= LINES) {
+
+        /* Skip over spaces */
+#ifdef USE_SIMD
+        if (simd == SIMD_AVX2) {
+            i = skip_blanks_avx2(col, i, LINES + 1);
+        } else if (simd == SIMD_SSE2) {
+            i = skip_blanks_sse2(col, i, LINES + 1);
+        } else
+#endif
+        while (i <= LINES && (col[i] == ' ' || col[i] == -1)) {
+            i++;
+        }
+
+        if (i > LINES) {
+            break;
+        }
+
+        /* Go to the head of this column */
+        z = i;
+        y = 0;
+#ifdef USE_SIMD
+        if (simd != SIMD_NONE) {
+            i = (simd == SIMD_AVX2) ? skip_stream_avx2(col, i, LINES + 1)
+                                    : skip_stream_sse2(col, i, LINES + 1);
+            y = i - z;
+            clear_heads(base + z, y);
+            if (changes && simd == SIMD_AVX2) {
+                change_glyphs_avx2(base, block, z, i);
+            } else if (changes) {
+                change_glyphs_sse2(base, block, z, i);
+            }
+        } else
+#endif
+        while (i <= LINES && (col[i] != ' ' && col[i] != -1)) {
+            set_head(base + i, false);
+            if (changes && (block[i] & 7) == 0) {
+                set_cell(base + i, rand_glyph(block[i]));
+            }
+            i++;
+            y++;
+        }
+
+        if (i > LINES) {
+            set_cell(base + z, ' ');
+            continue;
+        }
+
+        set_cell(base + i, rng_range(r, randnum) + randmin);
+        set_head(base + i, true);
+
+        /* If we're at the top of the column and it's reached its
+           full length (about to start moving down), we do this
+           to get it moving.  This is also how we keep segments not
+           already growing from growing accidentally =>
+         */
+        if (y > c->length || firstcoldone) {
+            set_cell(base + z, ' ');
+            set_cell(base, -1);
+        }
+        firstcoldone = 1;
+        i++;
+    }
+}
+
+/* Same as update_column_new(), but going from one stream to the next
+   instead of over every cell, so a step costs what's falling rather
+   than the height of the screen. The cells come out the same, except
+   that -k draws its random numbers only for the cells in streams. */
+ALWAYS_INLINE void update_column_sparse(int j, int changes) {
+    int i, n, z, e, firstcoldone = 0;
+    int base = cell_index(0, j);
+    int *col = cell_val + base;
+    column *c = &columns[j / 2];
+    uint64_t *r = &c->rng;
+    uint32_t x;
+    stream *s;
+
+    if (col[0] == -1 && col[1] == ' ' && c->spaces > 0) {
+        c->spaces--;
+    } else if (col[0] == -1 && col[1] == ' ') {
+        c->length = rng_range(r, LINES - 3) + 3;
+        set_cell(base, rng_range(r, randnum) + randmin);
+
+        c->spaces = rng_range(r, LINES) + 1;
+
+        /* A new stream on top of the others */
+        c->first = (c->first + stream_cap - 1) % stream_cap;
+        c->nstreams++;
+        s = column_stream(j, 0);
+        s->top = 0;
+        s->bottom = 0;
+    }
+
+    for (n = 0; n < c->nstreams; n++) {
+        s = column_stream(j, n);
+        z = s->top;
+        e = s->bottom;
+
+        /* Only the bottom of a stream is ever its head */
+        set_head(base + e, false);
+        if (changes) {
+            for (i = z; i <= e; i++) {
+                x = rng_next(r);
+                if ((x & 7) == 0) {
+                    set_cell(base + i, rand_glyph(x));
+                }
+            }
+        }
+
+        /* Running off the bottom, so it only gets shorter. Being the
+           lowest, it's also the last one. */
+        if (e == LINES) {
+            set_cell(base + z, ' ');
+            if (z == e) {
+                c->nstreams--;
+            } else {
+                s->top++;
+            }
+            continue;
+        }
+
+        set_cell(base + e + 1, rng_range(r, randnum) + randmin);
+        set_head(base + e + 1, true);
+        s->bottom++;
+
+        /* Same as in update_column_new(), the top stream keeps growing
+           until it's long enough. Clearing row 0 takes it off the top
+           one too. */
+        if (e - z + 1 > c->length || firstcoldone) {
+            set_cell(base + z, ' ');
+            set_cell(base, -1);
+            s->top++;
+            if (n > 0 && column_stream(j, 0)->top == 0) {
+                column_stream(j, 0)->top = 1;
+            }
+        }
+        firstcoldone = 1;
+    }
+}
+
+/* Step the columns from first up to last that are due. oldstyle,
+   sparse, changes and simd are constants in each copy of this, see
+   select_kernels. */
+ALWAYS_INLINE void step_columns(int first, int last, uint32_t *block,
+                                int oldstyle, int sparse, int changes,
+                                int simd) {
+    int j;
+
+    for (j = first; j < last; j += 2) {
+        if ((count > columns[j / 2].updates || asynch == 0) && paused == 0) {
+            if (oldstyle) {
+                update_column_old(j);
+            } else if (sparse) {
+                update_column_sparse(j, changes);
+            } else {
+                update_column_new(j, block, changes, simd);
+            }
+        }
+    }
+}
+
+void step_new(int first, int last, uint32_t *block) {
+    step_columns(first, last, block, 0, 0, 0, SIMD_NONE);
+}
+
+void step_new_changes(int first, int last, uint32_t *block) {
+    step_columns(first, last, block, 0, 0, 1, SIMD_NONE);
+}
+
+#ifdef USE_SIMD
+void step_new_sse2(int first, int last, uint32_t *block) {
+    step_columns(first, last, block, 0, 0, 0, SIMD_SSE2);
+}
+
+void step_new_changes_sse2(int first, int last, uint32_t *block) {
+    step_columns(first, last, block, 0, 0, 1, SIMD_SSE2);
+}
+
+void step_new_avx2(int first, int last, uint32_t *block) {
+    step_columns(first, last, block, 0, 0, 0, SIMD_AVX2);
+}
+
+void step_new_changes_avx2(int first, int last, uint32_t *block) {
+    step_columns(first, last, block, 0, 0, 1, SIMD_AVX2);
+}
+#endif
+
+void step_sparse(int first, int last, uint32_t *block) {
+    step_columns(first, last, block, 0, 1, 0, SIMD_NONE);
+}
+
+void step_sparse_changes(int first, int last, uint32_t *block) {
+    step_columns(first, last, block, 0, 1, 1, SIMD_NONE);
+}
+
+void step_old(int first, int last, uint32_t *block) {
+    step_columns(first, last, block, 1, 0, 0, SIMD_NONE);
+}
+
+/* The dense engine's kernels, by simd * 2 + changes */
+void (*step_new_kernels[6])(int, int, uint32_t *) = {
+#ifdef USE_SIMD
+    step_new, step_new_changes, step_new_sse2, step_new_changes_sse2,
+    step_new_avx2, step_new_changes_avx2
+#else
+    step_new, step_new_changes
+#endif
+};
+
+const char *simd_names[] = {"none", "sse2", "avx2"};
+
+/* The best SIMD_* the CPU can run */
+int simd_detect(void) {
+#ifdef USE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SIMD_SSE2;
+    }
+#endif
+    return SIMD_NONE;
+}
+
+/* Columns lo up to hi of row are under the message box, none if lo and
+   hi are the same */
+static inline void message_covers(int row, int *lo, int *hi) {
+    if (row >= msgbox.top && row < msgbox.top + msgbox.height) {
+        *lo = msgbox.left;
+        *hi = msgbox.left + msgbox.width;
+    } else {
+        *lo = *hi = 0;
+    }
+}
+
+/* Colors rainbow mode picks from */
+const int rainbow_colors[6] = {
+    COLOR_GREEN, COLOR_BLUE, COLOR_BLACK,
+    COLOR_YELLOW, COLOR_CYAN, COLOR_MAGENTA
+};
+
+/* Draw cell k, holding val, at row and column j. oldstyle, rainbow and
+   lambda are as in draw_frame_for(). */
+ALWAYS_INLINE void draw_cell(int row, int j, int k, int val, int oldstyle,
+                             int rainbow, int lambda) {
+    int ch, attr;
+
+    /* 0 and 1 are only ever old-style heads */
+    if ((oldstyle && val == 0) || (!rainbow && cell_head[k])) {
+        attr = style.head_attr;
+        if (oldstyle && val == 0) {
+            ch = style.head_ch;
+        } else {
+            ch = (val == -1) ? ' ' : val;
+        }
+    } else {
+        attr = rainbow ? rainbow_colors[rng_range(&draw_rng, 6)] : 0;
+        if (oldstyle && val == 1) {
+            attr |= style.bar_attr;
+            ch = '|';
+        } else {
+            attr |= style.body_attr[val & 1];
+            if (val == -1) {
+                ch = ' ';
+            } else if (lambda && val != ' ') {
+                ch = 0x3bb; /* λ */
+            } else {
+                ch = val;
+            }
+        }
+    }
+    put_cell(row, j, ch, attr);
+}
+
+/* Draw everything that changed since the last frame, a row at a time
+   from left to right so the cursor mostly advances by itself. oldstyle,
+   rainbow and lambda are constants in each copy of this, see
+   select_kernels, and bold and the matrix fonts are in style. */
+ALWAYS_INLINE void draw_frame_for(int oldstyle, int rainbow, int lambda) {
+    int row, i, j, k, val, step, lo, hi;
+    int top = oldstyle ? 0 : 1; /* Storage row shown on the top line */
+    int shifted = 0;
+
+    /* When every old-style column moved down exactly one row, the ANSI
+       backend can scroll the whole screen the same way and only draw the
+       new top row. The message box and the overlay would move along, so
+       not with -M or while 'i' shows or hides it, and a recording holds
+       cells, not scrolls, so not with --record or --hash-frames. */
+    if (oldstyle && backend == BACKEND_ANSI && msgbox.height == 0
+        && !show_overlay && !overlay_erase
+        && rec.out == NULL && shot.ch == NULL) {
+        shifted = 1;
+        for (j = 0; j <= COLS - 1 && shifted; j += 2) {
+            shifted = (columns[j / 2].scrolled == 1);
+        }
+        if (shifted) {
+            ansi_scroll_down(&term_out);
+        }
+    }
+
+    for (row = 0; row < LINES; row++) {
+        i = row + top;
+        message_covers(row, &lo, &hi);
+        for (j = 0; j <= COLS - 1; j += 2) {
+            /* The message box is drawn over columns lo up to hi. What
+               changed under it stays dirty for when it's gone. */
+            if (j >= lo && j < hi) {
+                continue;
+            }
+            /* New-style columns never scroll, so they have no ring */
+            if (oldstyle) {
+                k = cell_index(ring_row(i, j), j);
+                step = shifted ? (row == 0) * 2 : columns[j / 2].scrolled;
+            } else {
+                k = cell_index(i, j);
+                step = 0;
+            }
+            val = cell_val[k];
+
+            /* Only redraw what changed. Rainbow mode recolors every glyph
+               each frame, so those always go out. After a single old-style
+               scroll step a cell changed on screen only if it differs from
+               the one below it, which held its old place; several steps in
+               a row redraw the column. */
+            if (!cell_dirty[k] && !force_redraw && step <= 1
+                && !(step == 1 && val != cell_val[cell_index(ring_row(i + 1, j), j)])
+                && !(rainbow && val != ' ' && val != -1 && val != 0)) {
+                continue;
+            }
+            cell_dirty[k] = false;
+            cells_drawn++;
+            draw_cell(row, j, k, val, oldstyle, rainbow, lambda);
+        }
+    }
+
+    if (oldstyle) {
+        for (j = 0; j <= COLS - 1; j += 2) {
+            columns[j / 2].scrolled = 0;
+        }
+    }
+}
+
+void draw_new(void) { draw_frame_for(0, 0, 0); }
+void draw_new_lambda(void) { draw_frame_for(0, 0, 1); }
+void draw_new_rainbow(void) { draw_frame_for(0, 1, 0); }
+void draw_new_rainbow_lambda(void) { draw_frame_for(0, 1, 1); }
+void draw_old(void) { draw_frame_for(1, 0, 0); }
+void draw_old_lambda(void) { draw_frame_for(1, 0, 1); }
+void draw_old_rainbow(void) { draw_frame_for(1, 1, 0); }
+void draw_old_rainbow_lambda(void) { draw_frame_for(1, 1, 1); }
+
+/* Draw kernel for new style with --max-bandwidth. The heads go out
+   first, then the other cells that changed, a row at a time from where
+   the last frame stopped, until the bytes the rate leaves for this frame
+   are spent. What isn't drawn stays dirty for a later frame, and
+   rainbow mode only recolors those. Old-style scrolling draws what
+   scrolled by comparing with the frame before, so it can't leave cells
+   out and gets the plain kernels, which the limit only holds back. */
+void draw_capped(void) {
+    int row, n, j, k, lo, hi;
+    size_t budget = thr.budget > 0 ? (size_t) thr.budget : 0;
+
+    /* No limit yet, with no limit given, until a write has to wait */
+    if (thr.rate == 0) {
+        budget = (size_t) -1;
+    }
+
+    thr.behind = 0;
+    for (row = 0; row < LINES; row++) {
+        message_covers(row, &lo, &hi);
+        for (j = 0; j <= COLS - 1; j += 2) {
+            if (j >= lo && j < hi) {
+                continue;
+            }
+            k = cell_index(row + 1, j);
+            if (force_redraw) {
+                cell_dirty[k] = true;
+            }
+            if (cell_dirty[k] && cell_head[k]) {
+                cell_dirty[k] = false;
+                cells_drawn++;
+                draw_cell(row, j, k, cell_val[k], 0, rainbow, lambda);
+            }
+        }
+    }
+
+    for (n = 0; n < LINES; n++) {
+        row = (thr.row + n) % LINES;
+        if (term_out.len >= budget) {
+            thr.row = row;
+            thr.capped++;
+            thr.behind = 1;
+            return;
+        }
+        message_covers(row, &lo, &hi);
+        for (j = 0; j <= COLS - 1; j += 2) {
+            if (j >= lo && j < hi) {
+                continue;
+            }
+            k = cell_index(row + 1, j);
+            if (cell_dirty[k]) {
+                cell_dirty[k] = false;
+                cells_drawn++;
+                draw_cell(row, j, k, cell_val[k], 0, rainbow, lambda);
+            }
+        }
+    }
+}
+
+/* The draw kernels, by oldstyle * 4 + rainbow * 2 + lambda */
+void (*draw_kernels[8])(void) = {
+    draw_new, draw_new_lambda, draw_new_rainbow, draw_new_rainbow_lambda,
+    draw_old, draw_old_lambda, draw_old_rainbow, draw_old_rainbow_lambda
+};
+
+/* Pick the update and draw kernels for the display modes, and work out
+   what each kind of cell looks like in them. Has to run again whenever
+   a mode changes. */
+void select_kernels(void) {
+    int alt = (console || xwindow) ? ATTR_ALTCHARSET : 0;
+    int color = rainbow ? 0 : mcolor; /* Rainbow mode picks as it goes */
+
+    style.head_attr = COLOR_WHITE | alt | (bold ? ATTR_BOLD : 0);
+    style.head_ch = alt ? 183 : '&';
+    style.bar_attr = color | (bold ? ATTR_BOLD : 0);
+    style.body_attr[0] = color | alt | ((bold == 1 || bold == 2) ? ATTR_BOLD : 0);
+    style.body_attr[1] = color | alt | (bold == 2 ? ATTR_BOLD : 0);
+
+    draw_kernel = draw_kernels[(oldstyle != 0) * 4 + (rainbow != 0) * 2
+                               + (lambda != 0)];
+    if (thr.on && !oldstyle) {
+        draw_kernel = draw_capped;
+    }
+    if (oldstyle) {
+        step_kernel = step_old;
+    } else if (engine == ENGINE_SPARSE) {
+        step_kernel = changes ? step_sparse_changes : step_sparse;
+    } else {
+        step_kernel = step_new_kernels[simd * 2 + (changes != 0)];
+    }
+}
+
+/* Lay out the message box for text, which may run over several lines.
+   Control characters show as blanks and bytes that aren't UTF-8 as '?'.
+   The old box is blanked and the screen redrawn, to uncover what it was
+   over. */
+void message_set(const char *text) {
+    const unsigned char *p = (const unsigned char *) text;
+    const unsigned char *end = p + strlen(text);
+    const unsigned char *line;
+    int lines = 0, width = 0, n, ch, len, row, col;
+
+    /* Measure it, trailing line breaks left out */
+    while (end > p && (end[-1] == '\n' || end[-1] == '\r')) {
+        end--;
+    }
+    for (line = p; line < end; lines++) {
+        for (n = 0; line < end && *line != '\n'; n++) {
+            len = utf8_decode(line, end, &ch);
+            line += len ? len : 1;
+        }
+        if (n > width) {
+            width = n;
+        }
+        line++;
+    }
+
+    message_erase(-1, -1);
+    free(msgbox.cells);
+    msgbox.cells = NULL;
+    msgbox.width = msgbox.height = 0;
+    force_redraw = 1;
+    if (lines == 0) {
+        return;
+    }
+    msgbox.width = width + 4;
+    msgbox.height = lines + 2;
+    msgbox.cells = nmalloc(msgbox.width * msgbox.height * sizeof(int));
+    for (n = 0; n < msgbox.width * msgbox.height; n++) {
+        msgbox.cells[n] = ' ';
+    }
+
+    for (row = 1, line = p; line < end; row++) {
+        /* Center it: count its characters first */
+        for (n = 0, p = line; p < end && *p != '\n'; n++) {
+            len = utf8_decode(p, end, &ch);
+            p += len ? len : 1;
+        }
+        col = 2 + (width - n) / 2;
+        for (p = line; p < end && *p != '\n'; col++) {
+            len = utf8_decode(p, end, &ch);
+            if (len == 0) {
+                ch = '?';
+            } else if (ch < ' ' || ch == 0x7f) {
+                ch = ' ';
+            }
+            msgbox.cells[row * msgbox.width + col] = ch;
+            p += len ? len : 1;
+        }
+        line = p + 1;
+    }
+}
+
+/* Read the message from the --message-file. Unless must, a file that
+   can't be read keeps the message as it was. */
+void message_load(int must) {
+    struct stat st;
+    FILE *f;
+    char *text;
+    size_t n;
+
+    f = fopen(msgbox.path, "rb");
+    if (f == NULL || fstat(fileno(f), &st) == -1) {
+        if (must) {
+            c_die(" Unable to read %s: %s.\n", msgbox.path, strerror(errno));
+        }
+        if (f != NULL) {
+            fclose(f);
+        }
+        return;
+    }
+    text = nmalloc(st.st_size + 1);
+    n = fread(text, 1, st.st_size, f);
+    text[n] = '\0';
+    fclose(f);
+
+    msgbox.mtime = st.st_mtime;
+    msgbox.size = st.st_size;
+    msgbox.ino = st.st_ino;
+    message_set(text);
+    free(text);
+}
+
+/* Read the --message-file again if it changed. This runs every POLL_NS,
+   so an edit shows within half a second and frames pay nothing for it. */
+void message_poll(void) {
+    struct stat st;
+
+    if (stat(msgbox.path, &st) == -1
+        || (st.st_mtime == msgbox.mtime && st.st_size == msgbox.size
+            && st.st_ino == msgbox.ino)) {
+        return;
+    }
+    message_load(0);
+}
+
+/* Put the message box in the middle of the screen about to be drawn,
+   and blank where it was if it moved or changed since the last frame */
+void message_place(void) {
+    int top, left;
+
+    message_rect(msgbox.height, msgbox.width, LINES, COLS,
+                 &msgbox.top, &msgbox.left);
+    if (msgbox.erase_height > 0) {
+        message_rect(msgbox.erase_height, msgbox.erase_width,
+                     msgbox.erase_lines == -1 ? LINES : msgbox.erase_lines,
+                     msgbox.erase_cols == -1 ? COLS : msgbox.erase_cols,
+                     &top, &left);
+        blank_cells(top, left, msgbox.erase_height, msgbox.erase_width);
+    }
+}
+
+/* Draw the -M/-L message box laid out by message_set(), as far as it's
+   on the screen */
+void draw_message(void) {
+    int row, col, i, j;
+
+    for (row = 0; row < msgbox.height; row++) {
+        i = msgbox.top + row;
+        if (i < 0 || i >= LINES) {
+            continue;
+        }
+        for (col = 0; col < msgbox.width; col++) {
+            j = msgbox.left + col;
+            if (j >= 0 && j < COLS) {
+                put_cell(i, j, msgbox.cells[row * msgbox.width + col], 0);
+            }
+        }
+    }
+}
+
+/* The overlay's size: a header, a row per phase and the frame count */
+#define OVERLAY_LINES (PHASES + 2)
+#define OVERLAY_COLS 42
+
+/* Draw the phase timings in a box at the top left, toggled with 'i' */
+void draw_overlay(void) {
+    char line[64], frames[48];
+    int i, row = 0;
+
+    snprintf(line, sizeof(line), " %-8s %8s %8s %8s (us) ", "phase", "min",
+             "avg", "p99");
+    put_text(row++, 0, line);
+    for (i = 0; i < PHASES; i++) {
+        if (phases[i].count == 0) {
+            snprintf(line, sizeof(line), " %-8s %8s %8s %8s      ",
+                     phase_names[i], "-", "-", "-");
+        } else {
+            snprintf(line, sizeof(line), " %-8s %8.1f %8.1f %8.1f      ",
+                     phase_names[i], phases[i].min / 1e3,
+                     (double) phases[i].total / phases[i].count / 1e3,
+                     phase_percentile(&phases[i], 99) / 1e3);
+        }
+        put_text(row++, 0, line);
+    }
+    if (thr.on) {
+        snprintf(frames, sizeof(frames), "%lu frames, %lu held, %.1f/s",
+                 frames_drawn, thr.held, throttle_fps());
+    } else {
+        snprintf(frames, sizeof(frames), "%lu frames, %lu missed", frames_drawn,
+                 frames_missed);
+    }
+    snprintf(line, sizeof(line), " %-41s", frames);
+    put_text(row, 0, line);
+}
+
+#ifdef HAVE_PTHREAD_H
+/* The step threads. Columns only depend on themselves and each has its
+   own random number generator, so they can be stepped in any order and
+   the animation doesn't depend on how many threads there are. Thread 0
+   is the main thread. */
+typedef struct step_thread {
+    pthread_t thread;
+    int first, last;   /* Columns it steps */
+    uint32_t *block;   /* Its step_kernel() scratch space */
+} step_thread;
+
+step_thread *pool = NULL;
+int pool_size = 1;
+int pool_cols = 0;       /* Screen width the columns were split for */
+int pool_rows = 0;       /* Random numbers the blocks have room for */
+int pool_generation = 0; /* Bumped to start a step */
+int pool_pending = 0;    /* Threads still stepping */
+int pool_quit = 0;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+void *pool_main(void *arg) {
+    step_thread *t = arg;
+    int seen = 0;
+
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_generation == seen && !pool_quit) {
+            pthread_cond_wait(&pool_start, &pool_lock);
+        }
+        seen = pool_generation;
+        pthread_mutex_unlock(&pool_lock);
+        if (pool_quit) {
+            return NULL;
+        }
+
+        step_kernel(t->first, t->last, t->block);
+
+        pthread_mutex_lock(&pool_lock);
+        if (--pool_pending == 0) {
+            pthread_cond_signal(&pool_done);
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+/* Split the columns between the threads in whole chunks and give each
+   thread room for a column of random numbers. Done again whenever the
+   screen width changes or it gets taller than ever before, while the
+   threads are waiting. The blocks only grow, so -t terminals of several
+   sizes, whose groups take turns stepping, don't reallocate them. */
+void pool_layout(void) {
+    int i;
+    int chunks = (COLS + CHUNK_COLS - 1) / CHUNK_COLS;
+
+    if (pool_cols != COLS) {
+        pool_cols = COLS;
+        for (i = 0; i < pool_size; i++) {
+            pool[i].first = (int) ((long) chunks * i / pool_size) * CHUNK_COLS;
+            pool[i].last = (int) ((long) chunks * (i + 1) / pool_size) * CHUNK_COLS;
+            if (pool[i].last > COLS) {
+                pool[i].last = COLS;
+            }
+        }
+    }
+    if (pool_rows < LINES + 1) {
+        pool_rows = LINES + 1;
+        for (i = 1; i < pool_size; i++) {
+            free(pool[i].block);
+            pool[i].block = nmalloc(pool_rows * sizeof(uint32_t));
+        }
+    }
+}
+
+/* Stop the step threads, if any */
+void pool_stop(void) {
+    int i;
+
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_quit = 1;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_lock);
+    for (i = 1; i < pool_size; i++) {
+        pthread_join(pool[i].thread, NULL);
+        free(pool[i].block);
+    }
+    free(pool);
+    pool = NULL;
+    pool_size = 1;
+    pool_quit = 0;
+}
+
+/* Threads to use for --threads n, where 0 means one per CPU */
+int thread_count(int n) {
+#ifdef _SC_NPROCESSORS_ONLN
+    if (n == 0) {
+        n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+#endif
+    return n < 1 ? 1 : n;
+}
+
+/* Start n - 1 step threads to help the main one */
+void pool_init(int n) {
+    int i;
+
+    pool_stop();
+    if (n <= 1) {
+        return;
+    }
+    pool = nmalloc(n * sizeof(step_thread));
+    pool_size = n;
+    pool_generation = 0;
+    for (i = 0; i < n; i++) {
+        pool[i].block = NULL;
+    }
+    pool_cols = pool_rows = 0;
+    pool_layout();
+    for (i = 1; i < n; i++) {
+        if (pthread_create(&pool[i].thread, NULL, pool_main, &pool[i]) != 0) {
+            c_die(" Unable to start a step thread.\n");
+        }
+    }
+}
+#endif
+
+/* Advance the simulation one step, stepping every column that is due */
+void step_frame(void) {
+    count++;
+    if (count > 4) {
+        count = 1;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    if (pool != NULL) {
+        if (pool_cols != COLS || pool_rows < LINES + 1) {
+            pool_layout();
+        }
+        pthread_mutex_lock(&pool_lock);
+        pool_pending = pool_size - 1;
+        pool_generation++;
+        pthread_cond_broadcast(&pool_start);
+        pthread_mutex_unlock(&pool_lock);
+
+        step_kernel(pool[0].first, pool[0].last, rand_block);
+
+        /* Drawing has to wait for every column */
+        pthread_mutex_lock(&pool_lock);
+        while (pool_pending > 0) {
+            pthread_cond_wait(&pool_done, &pool_lock);
+        }
+        pthread_mutex_unlock(&pool_lock);
+        return;
+    }
+#endif
+    step_kernel(0, COLS, rand_block);
+}
+
+/* Draw what changed since the last frame. Any number of steps may have
+   been taken in between. */
+void render_frame(void) {
+    int force = force_redraw;
+
+    cells_drawn = 0;
+    if (rec.out != NULL) {
+        record_start();
+    }
+    message_place();
+    /* The kernels only draw every other column, so what the overlay left
+       between them has to go */
+    if (overlay_erase) {
+        blank_cells(0, 0, OVERLAY_LINES, OVERLAY_COLS);
+    }
+    draw_kernel();
+
+    force_redraw = 0;
+    frames_drawn++;
+    cells_drawn_total += cells_drawn;
+    if (cells_drawn > cells_drawn_max) {
+        cells_drawn_max = cells_drawn;
+    }
+
+    /* The message box stays on the screen until the next redraw, as
+       the kernels draw around it */
+    if (force && msgbox.height > 0) {
+        draw_message();
+    }
+    if (show_overlay) {
+        draw_overlay();
+    }
+
+    if (rec.out != NULL) {
+        record_frame();
+    }
+    phase_mark(PHASE_DRAW);
+    flush_frame();
+    phase_mark(PHASE_REFRESH);
+}
+
+/* Step the simulation of every group */
+void step_groups(void) {
+    int n;
+
+    if (group_count == 0) {
+        step_frame();
+        return;
+    }
+    for (n = 0; n < group_count; n++) {
+        group_use(n);
+        step_frame();
+    }
+}
+
+/* Draw every group's frame. A redraw forced by a key goes for all. */
+void render_groups(void) {
+    int n, force = force_redraw;
+
+    if (group_count == 0) {
+        render_frame();
+        msgbox.erase_height = 0;
+        overlay_erase = 0;
+        return;
+    }
+    for (n = 0; n < group_count; n++) {
+        group_use(n);
+        force_redraw = force;
+        render_frame();
+    }
+    msgbox.erase_height = 0;
+    overlay_erase = 0;
+}
+
+/* Step the simulation and draw the result */
+void advance_frame(void) {
+    step_frame();
+    render_frame();
+    msgbox.erase_height = 0;
+    overlay_erase = 0;
+}
+
+/* Set up what the main loop waits on between frames: keystrokes from fd,
+   signals through a pipe and, where there's a timerfd, the deadline */
+void events_init(int fd) {
+#ifdef HAVE_POLL_H
+    int i;
+
+    input_fd = fd;
+    if (pipe(signal_pipe) == 0) {
+        for (i = 0; i < 2; i++) {
+            fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK);
+            fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+    } else {
+        signal_pipe[0] = signal_pipe[1] = -1;
+    }
+#ifdef HAVE_SYS_TIMERFD_H
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+#else
+    (void) fd;
+#endif
+}
+
+/* Sleep until the monotonic clock reads deadline. Sleeping to an absolute
+   time rather than for an interval keeps the time spent drawing from
+   adding up into drift. A signal cuts the sleep short. */
+void sleep_until(int64_t deadline) {
+#ifdef HAVE_CLOCK_NANOSLEEP
+    struct timespec ts;
+
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+#else
+    int64_t left = deadline - clock_ns();
+
+    if (left > 0) {
+        napms((int) ((left + 999999) / 1000000));
+    }
+#endif
+}
+
+/* Sleep until deadline (never if it's negative), a keystroke or a signal,
+   whichever comes first */
+void wait_for_events(int64_t deadline) {
+#ifdef HAVE_POLL_H
+    struct pollfd fds[3];
+    int nfds = 0, timeout = -1, i;
+    char drain[64];
+    ssize_t n;
+
+    if (input_fd != -1) {
+        fds[nfds].fd = input_fd;
+        fds[nfds++].events = POLLIN;
+    }
+    if (signal_pipe[0] != -1) {
+        fds[nfds].fd = signal_pipe[0];
+        fds[nfds++].events = POLLIN;
+    }
+    if (deadline >= 0) {
+#ifdef HAVE_SYS_TIMERFD_H
+        if (timer_fd != -1) {
+            struct itimerspec its = {{0, 0}, {0, 0}};
+
+            /* A zero time would disarm the timer, so never ask for that */
+            its.it_value.tv_sec = deadline / 1000000000;
+            its.it_value.tv_nsec = deadline % 1000000000 + (deadline == 0);
+            timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+            fds[nfds].fd = timer_fd;
+            fds[nfds++].events = POLLIN;
+        } else
+#endif
+        {
+            int64_t left = deadline - clock_ns();
+
+            /* poll() counts in whole milliseconds, so round up */
+            timeout = left > 0 ? (int) ((left + 999999) / 1000000) : 0;
+        }
+    }
+
+    if (poll(fds, nfds, timeout) <= 0) {
+        return;
+    }
+    for (i = 0; i < nfds; i++) {
+        if (fds[i].revents == 0) {
+            continue;
+        }
+        if (fds[i].fd == input_fd) {
+            /* Left for wgetch, unless the terminal went away. Then stop
+               watching it, or we'd never sleep again. */
+            if (fds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+                input_fd = -1;
+            }
+#ifdef FIONREAD
+            /* Nor is there anything to wait for on a file or pipe that
+               is readable with nothing in it, or that can't say: it's at
+               the end (cmatrix < /dev/null, or started by a service).
+               wgetch still reads whatever is there each frame. */
+            {
+                int avail;
+
+                if (input_fd != -1 && !isatty(input_fd)
+                    && (ioctl(input_fd, FIONREAD, &avail) != 0 || avail == 0)) {
+                    input_fd = -1;
+                }
+            }
+#endif
+        } else {
+            /* Empty the signal pipe, or clear the expired timer */
+            do {
+                n = read(fds[i].fd, drain, sizeof(drain));
+            } while (n > 0);
+        }
+    }
+#else
+    if (deadline >= 0) {
+        sleep_until(deadline);
+    }
+#endif
+}
+
+/* Read a varint from f into v. Returns 0 if the file ends first. */
+int read_varint(FILE *f, uint64_t *v) {
+    int c, shift = 0;
+
+    *v = 0;
+    do {
+        c = getc(f);
+        if (c == EOF || shift > 63) {
+            return 0;
+        }
+        *v |= (uint64_t) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 1;
+}
+
+/* Take a varint off the frame being played back at *p into v. Returns 0
+   if the frame ends first. */
+int next_varint(unsigned char **p, uint64_t *v) {
+    unsigned char *end = play.buf + play.len;
+    int shift = 0;
+
+    *v = 0;
+    do {
+        if (*p == end || shift > 63) {
+            return 0;
+        }
+        *v |= (uint64_t) (**p & 0x7f) << shift;
+        shift += 7;
+    } while (*(*p)++ & 0x80);
+    return 1;
+}
+
+void replay_damaged(void) {
+    c_die(" The recording is damaged or cut short.\n");
+}
+
+/* Start playing back path */
+void replay_open(char *path) {
+    char magic[sizeof(RECORD_MAGIC) - 1];
+    int i;
+
+    play.in = fopen(path, "rb");
+    if (play.in == NULL) {
+        c_die(" Unable to open %s: %s.\n", path, strerror(errno));
+    }
+    if (fread(magic, 1, sizeof(magic), play.in) != sizeof(magic)
+        || memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0) {
+        c_die(" %s isn't a recording made by this version of cmatrix.\n",
+              path);
+    }
+    for (i = 0; i < 256; i++) {
+        play.cache[i].ch = -1;
+    }
+}
+
+/* Go back to the first frame */
+void replay_rewind(void) {
+    fseek(play.in, sizeof(RECORD_MAGIC) - 1, SEEK_SET);
+    free(play.ch);
+    free(play.attr);
+    play.ch = play.attr = NULL;
+    play.lines = play.cols = 0;
+}
+
+/* Read the next frame, and the nanoseconds it came after the one before.
+   Returns 0 at the end of the recording. */
+int replay_read(int64_t *dt) {
+    uint64_t us, resized, lines, cols, len;
+    int c = getc(play.in);
+
+    if (c == EOF) {
+        return 0;
+    }
+    ungetc(c, play.in);
+    if (!read_varint(play.in, &us) || !read_varint(play.in, &resized)) {
+        replay_damaged();
+    }
+    if (resized) {
+        if (!read_varint(play.in, &lines) || !read_varint(play.in, &cols)
+            || lines == 0 || cols == 0 || lines > 10000 || cols > 10000) {
+            replay_damaged();
+        }
+        play.lines = lines;
+        play.cols = cols;
+        free(play.ch);
+        free(play.attr);
+        play.ch = nmalloc(lines * cols * sizeof(int));
+        play.attr = nmalloc(lines * cols * sizeof(int));
+        memset(play.ch, 0, lines * cols * sizeof(int));
+    } else if (play.ch == NULL) {
+        /* The first frame has to say how big the screen is */
+        replay_damaged();
+    }
+
+    if (!read_varint(play.in, &len) || len > (1 << 30)) {
+        replay_damaged();
+    }
+    if (len > play.size) {
+        free(play.buf);
+        play.buf = nmalloc(len);
+        play.size = len;
+    }
+    if (fread(play.buf, 1, len, play.in) != len) {
+        replay_damaged();
+    }
+    play.len = len;
+    *dt = us * 1000;
+    return 1;
+}
+
+/* Draw code point ch with attributes attr where position pos of the
+   recording is, unless that's off the screen */
+void replay_cell(int pos, int ch, int attr) {
+    int row = pos / play.cols;
+    int col = pos % play.cols;
+    glyph *g = &play.cache[ch & 0xff];
+
+    play.ch[pos] = ch;
+    play.attr[pos] = attr;
+    if (row >= LINES || col >= COLS) {
+        return;
+    }
+    if (g->ch != ch) {
+        make_glyph(g, ch);
+    }
+    put_glyph(row, col, g, attr);
+    cells_drawn++;
+}
+
+/* Draw the frame replay_read read, unpacking what record_run packed */
+void replay_draw(void) {
+    unsigned char *p = play.buf;
+    uint64_t head, v, ch, count, step, i;
+    uint64_t cells = (uint64_t) play.lines * play.cols;
+    int64_t pos = -1;
+    int attr = 0;
+
+    while (p < play.buf + play.len) {
+        if (!next_varint(&p, &head)) {
+            replay_damaged();
+        }
+        v = head >> 2;
+        pos += 1 + ((int64_t) (v >> 1) ^ -(int64_t) (v & 1));
+        if (head & 1) {
+            if (!next_varint(&p, &v)
+                || v > (ATTR_COLOR | ATTR_BOLD | ATTR_ALTCHARSET)) {
+                replay_damaged();
+            }
+            attr = v;
+        }
+        count = 1;
+        step = 0;
+        if ((head & 2) && (!next_varint(&p, &count) || !next_varint(&p, &step)
+                           || count == 0 || count > cells || step > cells)) {
+            replay_damaged();
+        }
+        if (!next_varint(&p, &ch) || ch == 0 || ch > 0x10ffff) {
+            replay_damaged();
+        }
+        if (pos < 0 || pos + (count - 1) * step >= cells) {
+            replay_damaged();
+        }
+        for (i = 0; i < count; i++) {
+            replay_cell(pos + i * step, ch, attr);
+        }
+        pos += (count - 1) * step;
+    }
+}
+
+/* Draw everything the recording drew so far again */
+void replay_redraw(void) {
+    int i;
+
+    for (i = 0; i < play.lines * play.cols; i++) {
+        if (play.ch[i] != 0) {
+            replay_cell(i, play.ch[i], play.attr[i]);
+        }
+    }
+}
+
+/* Play the --replay file back at speed times the pace it was recorded
+   at, or as fast as it goes with 0, then exit. The keys changing how the
+   matrix looks do nothing: that's in the recording. */
+void replay(int screensaver, double speed) {
+    int64_t dt, deadline = clock_ns();
+    int keypress;
+
+    while (replay_read(&dt)) {
+        if (speed > 0) {
+            deadline += (int64_t) (dt / speed);
+        }
+        while (1) {
+#ifndef _WIN32
+            if (signal_status == SIGINT || signal_status == SIGQUIT
+                || signal_status == SIGTSTP) {
+                if (lock != 1)
+                    finish();
+                signal_status = 0;
+            }
+            if (signal_status == SIGWINCH) {
+                signal_status = 0;
+                resize_screen();
+                replay_redraw();
+                flush_frame();
+            }
+#endif
+            while ((keypress = wgetch(stdscr)) != ERR) {
+                if (screensaver == 1 || (keypress == 'q' && lock != 1)) {
+                    finish();
+                }
+                if (keypress == 'p' || keypress == 'P') {
+                    paused = !paused;
+                }
+            }
+            if (paused) {
+                wait_for_events(-1);
+                deadline = clock_ns();
+            } else if (speed > 0 && clock_ns() < deadline) {
+                wait_for_events(deadline);
+            } else {
+                break;
+            }
+        }
+
+        cells_drawn = 0;
+        replay_draw();
+        flush_frame();
+        frames_drawn++;
+        cells_drawn_total += cells_drawn;
+        if (cells_drawn > cells_drawn_max) {
+            cells_drawn_max = cells_drawn;
+        }
+    }
 }
 
-void usage(void) {
-    printf(" Usage: cmatrix -[abBcfhlsmVxk] [-u delay] [-C color] [-t tty] [-M message]\n");
-    printf(" -a: Asynchronous scroll\n");
-    printf(" -b: Bold characters on\n");
-    printf(" -B: All bold characters (overrides -b)\n");
-    printf(" -c: Use Japanese characters as seen in the original matrix. Requires appropriate fonts\n");
-    printf(" -f: Force the linux $TERM type to be on\n");
-    printf(" -l: Linux mode (uses matrix console font)\n");
-    printf(" -L: Lock mode (can be closed from another terminal)\n");
-    printf(" -o: Use old-style scrolling\n");
-    printf(" -h: Print usage and exit\n");
-    printf(" -n: No bold characters (overrides -b and -B, default)\n");
-    printf(" -s: \"Screensaver\" mode, exits on first keystroke\n");
-    printf(" -x: X window mode, use if your xterm is using mtx.pcf\n");
-    printf(" -V: Print version information and exit\n");
-    printf(" -M [message]: Prints your message in the center of the screen. Overrides -L's default message.\n");
-    printf(" -u delay (0 - 10, default 4): Screen update delay\n");
-    printf(" -C [color]: Use this color for matrix (default green)\n");
-    printf(" -r: rainbow mode\n");
-    printf(" -m: lambda mode\n");
-    printf(" -k: Characters change while scrolling. (Works without -o opt.)\n");
-    printf(" -t [tty]: Set tty to use\n");
-}
+/* The runs made by --benchmark, each on top of the command line flags */
+struct bench_mode {
+    char *name;
+    int oldstyle, asynch, changes, rainbow, classic, lambda, bold;
+};
 
-void version(void) {
-    printf(" CMatrix version %s (compiled %s, %s)\n",
-        VERSION, __TIME__, __DATE__);
-    printf("Email: abishekvashok@gmail.com\n");
-    printf("Web: https://github.com/abishekvashok/cmatrix\n");
+/* The bytes drawn into the benchmark's scratch file out since the last
+   call, emptying it again */
+double bench_bytes(FILE *out) {
+    off_t n;
+
+    fflush(out);
+    n = lseek(fileno(out), 0, SEEK_END);
+    if (ftruncate(fileno(out), 0) == 0) {
+        lseek(fileno(out), 0, SEEK_SET);
+    }
+    return n;
 }
 
+/* Time drawing the --replay file with the current backend */
+void bench_replay(FILE *out) {
+    struct timespec start, end;
+    double ns = 0, bytes = 0;
+    int64_t dt;
 
-/* nmalloc from nano by Big Gaute */
-void *nmalloc(size_t howmuch) {
-    void *r;
+    frames_drawn = 0;
+    cells_drawn_total = 0;
+    cells_drawn_max = 0;
+    replay_rewind();
+    var_init();
+    clear();
+    refresh();
+    bench_bytes(out);
 
-    if (!(r = malloc(howmuch))) {
-        c_die("CMatrix: malloc: out of memory!");
+    while (replay_read(&dt)) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        cells_drawn = 0;
+        replay_draw();
+        flush_frame();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns += (end.tv_sec - start.tv_sec) * 1e9
+              + (end.tv_nsec - start.tv_nsec);
+        frames_drawn++;
+        cells_drawn_total += cells_drawn;
+        bytes += bench_bytes(out);
+    }
+    if (frames_drawn == 0) {
+        c_die(" The recording has no frames in it.\n");
     }
 
-    return r;
+    printf(" %-8s %-10s %12.1f %12.0f %12.1f %12.1f\n",
+           backend == BACKEND_ANSI ? "ansi" : "ncurses", "replay",
+           frames_drawn * 1e9 / ns, ns / frames_drawn,
+           (double) cells_drawn_total / frames_drawn, bytes / frames_drawn);
 }
 
-/* Initialize the global variables */
-void var_init() {
-    int i, j;
+/* Time the update and render pipeline without a terminal. Both backends
+   draw into a scratch file at a fixed size, with no delay between frames.
+   With --replay, they draw the recording instead. */
+void benchmark(void) {
+    struct bench_mode modes[] = {
+        {"default", 0, 0, 0, 0, 0, 0, 0},
+        {"-o", 1, 0, 0, 0, 0, 0, 0},
+        {"-a", 0, 1, 0, 0, 0, 0, 0},
+        {"-k", 0, 0, 1, 0, 0, 0, 0},
+        {"-r", 0, 0, 0, 1, 0, 0, 0},
+        {"-c", 0, 0, 0, 0, 1, 0, 0},
+        {"-m", 0, 0, 0, 0, 0, 1, 0},
+        {"-b", 0, 0, 0, 0, 0, 0, 1},
+        {"-o -r", 1, 0, 0, 1, 0, 0, 0},
+        {"-o -B -m", 1, 0, 0, 0, 0, 1, 2},
+        {"-k -r -m", 0, 0, 1, 1, 0, 1, 0},
+    };
+    struct bench_mode flags = {NULL, oldstyle, asynch, changes, rainbow,
+                               classic, lambda, bold};
+    char *backends[] = {"ncurses", "ansi"};
+    int color = mcolor;
+    int f;
+    size_t m, b;
+    char size[16];
+    double ns, bytes;
+    struct timespec start, end;
+    FILE *out, *in;
+    SCREEN *scr;
 
-    if (matrix != NULL) {
-        free(matrix[0]);
-        free(matrix);
+    if (bench_lines < 10 || bench_cols < 10 || bench_frames < 1) {
+        c_die(" --benchmark needs at least 10 lines, 10 columns and 1 frame.\n");
     }
 
-    matrix = nmalloc(sizeof(cmatrix *) * (LINES + 1));
-    matrix[0] = nmalloc(sizeof(cmatrix) * (LINES + 1) * COLS);
-    for (i = 1; i <= LINES; i++) {
-        matrix[i] = matrix[i - 1] + COLS;
+    /* A scratch file rather than the null device, to count the bytes */
+    out = tmpfile();
+    if (!out) {
+        c_die(" Unable to make a scratch file: %s.\n", strerror(errno));
     }
-
-    if (length != NULL) {
-        free(length);
+    in = fopen(NULL_DEVICE, "r");
+    if (!in) {
+        c_die(" Unable to open %s: %s.\n", NULL_DEVICE, strerror(errno));
     }
-    length = nmalloc(COLS * sizeof(int));
 
-    if (spaces != NULL) {
-        free(spaces);
+    /* ncurses can't ask the null device for its size, so tell it */
+    snprintf(size, sizeof(size), "%d", bench_lines);
+#ifdef _WIN32
+    _putenv_s("LINES", size);
+#else
+    setenv("LINES", size, 1);
+#endif
+    snprintf(size, sizeof(size), "%d", bench_cols);
+#ifdef _WIN32
+    _putenv_s("COLUMNS", size);
+#else
+    setenv("COLUMNS", size, 1);
+#endif
+    scr = newterm("xterm", out, in);
+    if (scr == NULL) {
+        c_die(" Unable to set up the \"xterm\" terminal type for --benchmark.\n");
     }
-    spaces = nmalloc(COLS* sizeof(int));
+    set_term(scr);
+    leaveok(stdscr, TRUE);
+    init_colors();
 
-    if (updates != NULL) {
-        free(updates);
+    if (play.in != NULL) {
+        printf(" CMatrix benchmark: %d x %d, replaying a recording\n",
+               LINES, COLS);
+    } else {
+        printf(" CMatrix benchmark: %d x %d, %d frames, seed %u, %s engine, "
+               "SIMD %s\n", LINES, COLS, bench_frames, seed,
+               engine == ENGINE_SPARSE ? "sparse" : "dense",
+               simd_names[simd]);
     }
-    updates = nmalloc(COLS * sizeof(int));
+    printf(" %-8s %-10s %12s %12s %12s %12s\n", "backend", "mode",
+           "frames/s", "ns/frame", "cells/frame", "bytes/frame");
 
-    /* Make the matrix */
-    for (i = 0; i <= LINES; i++) {
-        for (j = 0; j <= COLS - 1; j += 2) {
-            matrix[i][j].val = -1;
+    term_out.fd = fileno(out);
+    for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        backend = (b == 0) ? BACKEND_NCURSES : BACKEND_ANSI;
+        if (backend == BACKEND_ANSI && (console || xwindow)) {
+            continue;
         }
-    }
+        if (play.in != NULL) {
+            bench_replay(out);
+            continue;
+        }
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            oldstyle = flags.oldstyle || modes[m].oldstyle;
+            asynch = flags.asynch || modes[m].asynch;
+            changes = flags.changes || modes[m].changes;
+            rainbow = flags.rainbow || modes[m].rainbow;
+            classic = flags.classic || modes[m].classic;
+            lambda = flags.lambda || modes[m].lambda;
+            bold = modes[m].bold ? modes[m].bold : flags.bold;
+            mcolor = color;
+            count = 0;
+            frames_drawn = 0;
+            cells_drawn_total = 0;
+            cells_drawn_max = 0;
 
-    for (j = 0; j <= COLS - 1; j += 2) {
-        /* Set up spaces[] array of how many spaces to skip */
-        spaces[j] = (int) rand() % LINES + 1;
+            seed_rng(seed);
+            init_glyph_range();
+            var_init();
+            select_kernels();
+            clear();
+            refresh();
+            bench_bytes(out);
 
-        /* And length of the stream */
-        length[j] = (int) rand() % (LINES - 3) + 3;
+            ns = 0;
+            bytes = 0;
+            for (f = 0; f < bench_frames; f++) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                advance_frame();
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                ns += (end.tv_sec - start.tv_sec) * 1e9
+                      + (end.tv_nsec - start.tv_nsec);
 
-        /* Sentinel value for creation of new objects */
-        matrix[1][j].val = ' ';
+                bytes += bench_bytes(out);
+            }
 
-        /* And set updates[] array for update speed. */
-        updates[j] = (int) rand() % 3 + 1;
+            printf(" %-8s %-10s %12.1f %12.0f %12.1f %12.1f\n", backends[b],
+                   modes[m].name, bench_frames * 1e9 / ns, ns / bench_frames,
+                   (double) cells_drawn_total / frames_drawn,
+                   bytes / bench_frames);
+        }
     }
 
-}
+#ifdef HAVE_PTHREAD_H
+    /* How the simulation step alone scales with --threads. Drawing stays
+       on one thread, so it's left out. */
+    if (thread_count(threads) > 1 && play.in == NULL) {
+        double ns_one = 0;
+        int t;
 
-#ifndef _WIN32
-void sighandler(int s) {
-    signal_status = s;
-}
+        oldstyle = flags.oldstyle;
+        asynch = flags.asynch;
+        changes = flags.changes;
+        rainbow = flags.rainbow;
+        classic = flags.classic;
+        lambda = flags.lambda;
+        bold = flags.bold;
+        select_kernels();
+        printf("\n %-8s %12s %12s %12s\n", "threads", "steps/s", "ns/step",
+               "speedup");
+        for (t = 1; t <= thread_count(threads); t++) {
+            seed_rng(seed);
+            init_glyph_range();
+            var_init();
+            pool_init(t);
+            count = 0;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (f = 0; f < bench_frames; f++) {
+                step_frame();
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ns = (end.tv_sec - start.tv_sec) * 1e9
+                 + (end.tv_nsec - start.tv_nsec);
+            if (t == 1) {
+                ns_one = ns;
+            }
+            printf(" %-8d %12.1f %12.0f %12.2f\n", t, bench_frames * 1e9 / ns,
+                   ns / bench_frames, ns_one / ns);
+        }
+        pool_stop();
+    }
 #endif
 
-void resize_screen(void) {
-#ifdef _WIN32
-    BOOL result;
-    HANDLE hStdHandle;
-    CONSOLE_SCREEN_BUFFER_INFO csbiInfo;
+    endwin();
+    delscreen(scr);
+    fclose(out);
+    fclose(in);
+}
 
-    hStdHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-    if (hStdHandle == INVALID_HANDLE_VALUE)
-        return;
-#else
-    char *tty;
-    int fd = 0;
-    int result = 0;
-    struct winsize win;
+/* Run the animation without a terminal for --frames frames, at --lines
+   by --cols, and print a hash of the screen after each one: the glyph
+   and attributes of every cell. The same seed and options always give
+   the same hashes, whatever the engine, SIMD, threads or drawing shortcuts,
+   which is what the golden tests check. Frames go to the ansi backend
+   writing into the null device. */
+void hash_frames(void) {
+    uint64_t h;
+    int f, i;
+    int fd = open(NULL_DEVICE, O_WRONLY);
 
-    tty = ttyname(0);
-    if (!tty) {
-        return;
-#endif
-#ifdef _WIN32
-    result = GetConsoleScreenBufferInfo(hStdHandle, &csbiInfo);
-    if (!result)
-        return;
-    LINES = csbiInfo.dwSize.Y;
-    COLS = csbiInfo.dwSize.X;
-#else
-    }
-    fd = open(tty, O_RDWR);
     if (fd == -1) {
-        return;
+        c_die(" Unable to open %s: %s.\n", NULL_DEVICE, strerror(errno));
     }
-    result = ioctl(fd, TIOCGWINSZ, &win);
-    if (result == -1) {
-        return;
+    if (bench_lines < 10 || bench_cols < 10 || bench_frames < 1) {
+        c_die(" --hash-frames needs at least 10 lines, 10 columns and 1 frame.\n");
     }
+    LINES = bench_lines;
+    COLS = bench_cols;
+    backend = BACKEND_ANSI;
+    term_out.fd = fd;
 
-    COLS = win.ws_col;
-    LINES = win.ws_row;
+    shot.lines = LINES;
+    shot.cols = COLS;
+    shot.ch = nmalloc(LINES * COLS * sizeof(int));
+    shot.attr = nmalloc(LINES * COLS * sizeof(int));
+    memset(shot.ch, 0, LINES * COLS * sizeof(int));
+    memset(shot.attr, 0, LINES * COLS * sizeof(int));
+
+    init_glyph_range();
+    var_init();
+    select_kernels();
+#ifdef HAVE_PTHREAD_H
+    pool_init(thread_count(threads));
 #endif
 
-    if (LINES < 10) {
-        LINES = 10;
-    }
-    if (COLS < 10) {
-        COLS = 10;
-    }
+    for (f = 0; f < bench_frames; f++) {
+        advance_frame();
 
-#ifdef HAVE_RESIZETERM
-    resizeterm(LINES, COLS);
-#ifdef HAVE_WRESIZE
-    if (wresize(stdscr, LINES, COLS) == ERR) {
-        c_die("Cannot resize window!");
+        /* 64-bit FNV-1a, a cell value at a time */
+        h = 0xcbf29ce484222325ULL;
+        for (i = 0; i < LINES * COLS; i++) {
+            h = (h ^ (uint32_t) shot.ch[i]) * 0x100000001b3ULL;
+            h = (h ^ (uint32_t) shot.attr[i]) * 0x100000001b3ULL;
+        }
+        printf("%016llx\n", (unsigned long long) h);
     }
-#endif /* HAVE_WRESIZE */
-#endif /* HAVE_RESIZETERM */
 
-    var_init();
-    /* Do these because width may have changed... */
-    clear();
-    refresh();
+#ifdef HAVE_PTHREAD_H
+    pool_stop();
+#endif
+    close(fd);
 }
 
 int main(int argc, char *argv[]) {
-    int i, y, z, optchr, keypress;
-    int j = 0;
-    int count = 0;
+    int optchr, keypress;
+    int stepped = 0, steps, resize_pending = 0;
+    int64_t now, next_step, next_frame, next_poll = 0, step_ns, frame_ns, missed;
+    int64_t sent;
+    unsigned long long written;
     int screensaver = 0;
-    int asynch = 0;
-    int bold = 0;
     int force = 0;
-    int firstcoldone = 0;
-    int oldstyle = 0;
-    int random = 0;
-    int update = 4;
-    int highnum = 0;
-    int mcolor = COLOR_GREEN;
-    int rainbow = 0;
-    int lambda = 0;
-    int randnum = 0;
-    int randmin = 0;
-    int pause = 0;
-    int classic = 0;
-    int changes = 0;
-    char *msg = "";
+    int bench = 0;
+    int hash = 0;
     char *tty = NULL;
+    char *charset_file = NULL;
+    char *record_file = NULL;
+    char *replay_file = NULL;
+    char *export_file = NULL;
+    double speed = 1;
+    char *end;
+    FILE *ftty = NULL;
 
-    srand((unsigned) time(NULL));
     setlocale(LC_ALL, "");
 
     /* Many thanks to morph- (morph@jmss.com) for this getopt patch */
     opterr = 0;
+#ifdef HAVE_GETOPT_H
+    while ((optchr = getopt_long(argc, argv, "abBcfhlLnrosmxkVM:u:C:t:",
+                                 long_options, NULL)) != EOF) {
+#else
     while ((optchr = getopt(argc, argv, "abBcfhlLnrosmxkVM:u:C:t:")) != EOF) {
+#endif
         switch (optchr) {
         case 's':
             screensaver = 1;
@@ -426,11 +4188,200 @@ int main(int argc, char *argv[]) {
             changes = 1;
             break;
         case 't':
-            tty = optarg;
+            tty_add(optarg);
+            break;
+        case OPT_STATS:
+            show_stats = 1;
+            break;
+        case OPT_SEED:
+            seed = strtoul(optarg, NULL, 0);
+            seeded = 1;
+            break;
+        case OPT_BENCHMARK:
+            bench = 1;
+            break;
+        case OPT_HASH_FRAMES:
+            hash = 1;
+            break;
+        case OPT_MESSAGE_FILE:
+            msgbox.path = optarg;
+            break;
+        case OPT_LINES:
+            bench_lines = atoi(optarg);
+            break;
+        case OPT_COLS:
+            bench_cols = atoi(optarg);
+            break;
+        case OPT_FRAMES:
+            bench_frames = atoi(optarg);
+            break;
+        case OPT_BACKEND:
+            if (!strcasecmp(optarg, "ncurses")) {
+                backend = BACKEND_NCURSES;
+            } else if (!strcasecmp(optarg, "ansi")) {
+                backend = BACKEND_ANSI;
+            } else {
+                c_die(" Invalid backend selection\n Valid "
+                       "backends are ncurses and ansi.\n");
+            }
+            break;
+        case OPT_FPS:
+            fps = atoi(optarg);
+            if (fps < 0 || fps > 1000) {
+                c_die(" --fps must be between 0 and 1000.\n");
+            }
+            break;
+        case OPT_THREADS:
+            threads = atoi(optarg);
+            if (threads < 0) {
+                c_die(" --threads can't be negative.\n");
+            }
+#ifndef HAVE_PTHREAD_H
+            if (threads != 1) {
+                c_die(" This cmatrix was built without thread support.\n");
+            }
+#endif
+            break;
+        case OPT_CHARSET:
+            charset_file = optarg;
+            break;
+        case OPT_RECORD:
+            record_file = optarg;
+            break;
+        case OPT_REPLAY:
+            replay_file = optarg;
+            break;
+        case OPT_SPEED:
+            speed = atof(optarg);
+            if (speed < 0) {
+                c_die(" --speed can't be negative.\n");
+            }
+            break;
+        case OPT_EXPORT:
+#ifndef USE_EXPORT
+            c_die(" This cmatrix was built without --export support.\n");
+#endif
+            export_file = optarg;
+            break;
+        case OPT_ENGINE:
+            if (!strcasecmp(optarg, "dense")) {
+                engine = ENGINE_DENSE;
+            } else if (!strcasecmp(optarg, "sparse")) {
+                engine = ENGINE_SPARSE;
+            } else {
+                c_die(" Invalid engine selection\n Valid "
+                       "engines are dense and sparse.\n");
+            }
+            break;
+        case OPT_SIMD:
+            if (!strcasecmp(optarg, "auto")) {
+                simd = -1;
+            } else if (!strcasecmp(optarg, "none")) {
+                simd = SIMD_NONE;
+            } else if (!strcasecmp(optarg, "sse2")) {
+                simd = SIMD_SSE2;
+            } else if (!strcasecmp(optarg, "avx2")) {
+                simd = SIMD_AVX2;
+            } else {
+                c_die(" Invalid SIMD selection\n Valid "
+                       "choices are auto, avx2, sse2 and none.\n");
+            }
+            break;
+        case OPT_MAX_BANDWIDTH:
+            thr.limit = strtod(optarg, &end);
+            if (*end == 'k' || *end == 'K') {
+                thr.limit *= 1000;
+                end++;
+            } else if (*end == 'm' || *end == 'M') {
+                thr.limit *= 1000000;
+                end++;
+            }
+            if (end == optarg || *end != '\0' || thr.limit < 0) {
+                c_die(" --max-bandwidth takes bytes per second, like 20000 or 20k.\n");
+            }
+            thr.on = 1;
             break;
         }
     }
 
+    if (hash && (bench || record_file != NULL || replay_file != NULL
+                 || export_file != NULL || thr.on || tty_count > 0)) {
+        c_die(" --hash-frames can't be used with --benchmark, --record, "
+              "--replay, --export, --max-bandwidth or -t.\n");
+    }
+    if (record_file != NULL && (replay_file != NULL || bench)) {
+        c_die(" --record can't be used with --replay or --benchmark.\n");
+    }
+    if (export_file != NULL) {
+        if (bench) {
+            c_die(" --export can't be used with --benchmark.\n");
+        }
+        /* What's exported is what the ansi backend writes */
+        backend = BACKEND_ANSI;
+    }
+    if (tty_count > 1) {
+#ifdef _WIN32
+        c_die(" Only one -t can be given on Windows.\n");
+#endif
+        if (record_file != NULL || replay_file != NULL || export_file != NULL) {
+            c_die(" --record, --replay and --export can't be used with more "
+                  "than one -t.\n");
+        }
+        /* Frames are built once and sent to each terminal as they are */
+        backend = BACKEND_ANSI;
+    }
+    if (tty_count > 0) {
+        tty = ttys[0].path;
+    }
+    if (thr.on) {
+        if (bench || tty_count > 1) {
+            c_die(" --max-bandwidth can't be used with --benchmark or more "
+                  "than one -t.\n");
+        }
+        /* Only the ansi backend knows what a frame comes to in bytes */
+        backend = BACKEND_ANSI;
+    }
+    if (simd == -1) {
+        simd = simd_detect();
+    } else if (simd > simd_detect()) {
+        c_die(" This CPU (or this cmatrix build) can't do --simd %s.\n",
+              simd_names[simd]);
+    }
+    if (replay_file != NULL) {
+        replay_open(replay_file);
+    }
+    if (record_file != NULL) {
+        record_open(record_file);
+    }
+
+    if (charset_file != NULL) {
+        load_charset(charset_file);
+    }
+
+    if (msgbox.path != NULL) {
+        message_load(1);
+    } else {
+        message_set(msg);
+    }
+
+    if (backend == BACKEND_ANSI && (console || xwindow)) {
+        c_die(" The ansi backend can't use the matrix fonts of -l and -x.\n");
+    }
+
+    if (!seeded) {
+        seed = (bench || hash) ? 1 : (unsigned) time(NULL);
+    }
+    seed_rng(seed);
+
+    if (bench) {
+        benchmark();
+        exit(0);
+    }
+    if (hash) {
+        hash_frames();
+        exit(0);
+    }
+
     /* Clear TERM variable on Windows */
 #ifdef _WIN32
     _putenv_s("TERM", "");
@@ -445,7 +4396,7 @@ int main(int argc, char *argv[]) {
 #endif
     }
     if (tty) {
-        FILE *ftty = fopen(tty, "r+");
+        ftty = fopen(tty, "r+");
         if (!ftty) {
             fprintf(stderr, "cmatrix: error: '%s' couldn't be opened: %s.\n",
                     tty, strerror(errno));
@@ -469,6 +4420,7 @@ int main(int argc, char *argv[]) {
     timeout(0);
     leaveok(stdscr, TRUE);
     curs_set(0);
+    events_init(fileno(ftty ? ftty : stdin));
 #ifndef _WIN32
     signal(SIGINT, sighandler);
     signal(SIGQUIT, sighandler);
@@ -493,53 +4445,36 @@ if (console) {
         c_die(" Unable to use both \"setfont\" and \"consolechars\".\n");
 #endif
 }
-    if (has_colors()) {
-        start_color();
-        /* Add in colors, if available */
-#ifdef HAVE_USE_DEFAULT_COLORS
-        if (use_default_colors() != ERR) {
-            init_pair(COLOR_BLACK, -1, -1);
-            init_pair(COLOR_GREEN, COLOR_GREEN, -1);
-            init_pair(COLOR_WHITE, COLOR_WHITE, -1);
-            init_pair(COLOR_RED, COLOR_RED, -1);
-            init_pair(COLOR_CYAN, COLOR_CYAN, -1);
-            init_pair(COLOR_MAGENTA, COLOR_MAGENTA, -1);
-            init_pair(COLOR_BLUE, COLOR_BLUE, -1);
-            init_pair(COLOR_YELLOW, COLOR_YELLOW, -1);
-        } else {
-#else
-        { /* Hack to deal the after effects of else in HAVE_USE_DEFAULT_COLOURS */
+    init_colors();
+    init_glyph_range();
+
+    /* The ansi backend writes where ncurses would */
+    term_out.fd = fileno(ftty ? ftty : stdout);
+    var_init();
+    select_kernels();
+#ifndef _WIN32
+    if (tty_count > 1) {
+        ttys_open(fileno(ftty));
+    }
 #endif
-            init_pair(COLOR_BLACK, COLOR_BLACK, COLOR_BLACK);
-            init_pair(COLOR_GREEN, COLOR_GREEN, COLOR_BLACK);
-            init_pair(COLOR_WHITE, COLOR_WHITE, COLOR_BLACK);
-            init_pair(COLOR_RED, COLOR_RED, COLOR_BLACK);
-            init_pair(COLOR_CYAN, COLOR_CYAN, COLOR_BLACK);
-            init_pair(COLOR_MAGENTA, COLOR_MAGENTA, COLOR_BLACK);
-            init_pair(COLOR_BLUE, COLOR_BLUE, COLOR_BLACK);
-            init_pair(COLOR_YELLOW, COLOR_YELLOW, COLOR_BLACK);
-        }
+#ifdef USE_EXPORT
+    if (export_file != NULL) {
+        export_open(export_file);
     }
+#endif
 
-    /* Set up values for random number generation */
-    if (classic) {
-        /* Half-width kana characters. In the movie they are y-axis flipped, and
-         * they appear alongside latin characters and numerals, but this is the
-         * closest we can do with a standard unicode set and a single number
-         * range */
-        randmin = 0xff66;
-        highnum = 0xff9d;
-    } else if (console || xwindow) {
-        randmin = 166;
-        highnum = 217;
-    } else {
-        randmin = 33;
-        highnum = 123;
+    if (play.in != NULL) {
+        replay(screensaver, speed);
+        finish();
     }
-    randnum = highnum - randmin;
-
-    var_init();
+#ifdef HAVE_PTHREAD_H
+    pool_init(thread_count(threads));
+#endif
 
+    /* The simulation steps every update * 10 ms and frames are drawn at
+       --fps, or after every step without it. Running late, we catch up on
+       steps but skip the frames we missed and draw just the latest. */
+    next_step = next_frame = phase_clock = clock_ns();
     while (1) {
 #ifndef _WIN32
         /* Check for signals */
@@ -549,7 +4484,9 @@ if (console) {
             /* exits */
         }
         if (signal_status == SIGWINCH) {
-            resize_screen();
+            /* Resize when the next frame is due, just the once however
+               many times the window changed size until then */
+            resize_pending = 1;
             signal_status = 0;
         }
 
@@ -558,13 +4495,9 @@ if (console) {
                     finish();
         }
 #endif
+        phase_mark(PHASE_SIGNALS);
 
-        count++;
-        if (count > 4) {
-            count = 1;
-        }
-
-        if ((keypress = wgetch(stdscr)) != ERR) {
+        while ((keypress = wgetch(stdscr)) != ERR) {
             if (screensaver == 1) {
 #ifdef USE_TIOCSTI
                 char *str = malloc(0);
@@ -593,15 +4526,18 @@ if (console) {
                     break;
                 case 'b':
                     bold = 1;
+                    force_redraw = 1;
                     break;
                 case 'B':
                     bold = 2;
+                    force_redraw = 1;
                     break;
                 case 'L':
                     lock = 1;
                     break;
                 case 'n':
                     bold = 0;
+                    force_redraw = 1;
                     break;
                 case '0': /* Fall through */
                 case '1': /* Fall through */
@@ -618,277 +4554,137 @@ if (console) {
                 case '!':
                     mcolor = COLOR_RED;
                     rainbow = 0;
+                    force_redraw = 1;
                     break;
                 case '@':
                     mcolor = COLOR_GREEN;
                     rainbow = 0;
+                    force_redraw = 1;
                     break;
                 case '#':
                     mcolor = COLOR_YELLOW;
                     rainbow = 0;
+                    force_redraw = 1;
                     break;
                 case '$':
                     mcolor = COLOR_BLUE;
                     rainbow = 0;
+                    force_redraw = 1;
                     break;
                 case '%':
                     mcolor = COLOR_MAGENTA;
                     rainbow = 0;
+                    force_redraw = 1;
                     break;
                 case 'r':
                      rainbow = 1;
                      break;
                 case 'm':
                      lambda = !lambda;
+                     force_redraw = 1;
                      break;
                 case '^':
                     mcolor = COLOR_CYAN;
                     rainbow = 0;
+                    force_redraw = 1;
                     break;
                 case '&':
                     mcolor = COLOR_WHITE;
                     rainbow = 0;
+                    force_redraw = 1;
                     break;
                 case 'p':
                 case 'P':
-                    pause = (pause == 0)?1:0;
+                    paused = (paused == 0)?1:0;
+                    break;
+                case 'i':
+                    show_overlay = !show_overlay;
+                    /* Uncover what was under it */
+                    overlay_erase = !show_overlay;
+                    force_redraw = 1;
                     break;
 
                 }
+                select_kernels();
             }
         }
-        for (j = 0; j <= COLS - 1; j += 2) {
-            if ((count > updates[j] || asynch == 0) && pause == 0) {
-
-                /* I don't like old-style scrolling, yuck */
-                if (oldstyle) {
-                    for (i = LINES - 1; i >= 1; i--) {
-                        matrix[i][j].val = matrix[i - 1][j].val;
-                    }
-                    random = (int) rand() % (randnum + 8) + randmin;
-
-                    if (matrix[1][j].val == 0) {
-                        matrix[0][j].val = 1;
-                    } else if (matrix[1][j].val == ' '
-                             || matrix[1][j].val == -1) {
-                        if (spaces[j] > 0) {
-                            matrix[0][j].val = ' ';
-                            spaces[j]--;
-                        } else {
-
-                            /* Random number to determine whether head of next column
-                               of chars has a white 'head' on it. */
-
-                            if (((int) rand() % 3) == 1) {
-                                matrix[0][j].val = 0;
-                            } else {
-                                matrix[0][j].val = (int) rand() % randnum + randmin;
-                            }
-                            spaces[j] = (int) rand() % LINES + 1;
-                        }
-                    } else if (random > highnum && matrix[1][j].val != 1) {
-                        matrix[0][j].val = ' ';
-                    } else {
-                        matrix[0][j].val = (int) rand() % randnum + randmin;
-                    }
-
-                } else { /* New style scrolling (default) */
-                    if (matrix[0][j].val == -1 && matrix[1][j].val == ' '
-                        && spaces[j] > 0) {
-                        spaces[j]--;
-                    } else if (matrix[0][j].val == -1
-                        && matrix[1][j].val == ' ') {
-                        length[j] = (int) rand() % (LINES - 3) + 3;
-                        matrix[0][j].val = (int) rand() % randnum + randmin;
-
-                        spaces[j] = (int) rand() % LINES + 1;
-                    }
-                    i = 0;
-                    y = 0;
-                    firstcoldone = 0;
-                    while (i <= LINES) {
-
-                        /* Skip over spaces */
-                        while (i <= LINES && (matrix[i][j].val == ' ' ||
-                               matrix[i][j].val == -1)) {
-                            i++;
-                        }
-
-                        if (i > LINES) {
-                            break;
-                        }
-
-                        /* Go to the head of this column */
-                        z = i;
-                        y = 0;
-                        while (i <= LINES && (matrix[i][j].val != ' ' &&
-                               matrix[i][j].val != -1)) {
-                            matrix[i][j].is_head = false;
-                            if (changes) {
-                                if (rand() % 8 == 0)
-                                    matrix[i][j].val = (int) rand() % randnum + randmin;
-                            }
-                            i++;
-                            y++;
-                        }
-
-                        if (i > LINES) {
-                            matrix[z][j].val = ' ';
-                            continue;
-                        }
-
-                        matrix[i][j].val = (int) rand() % randnum + randmin;
-                        matrix[i][j].is_head = true;
-
-                        /* If we're at the top of the column and it's reached its
-                           full length (about to start moving down), we do this
-                           to get it moving.  This is also how we keep segments not
-                           already growing from growing accidentally =>
-                         */
-                        if (y > length[j] || firstcoldone) {
-                            matrix[z][j].val = ' ';
-                            matrix[0][j].val = -1;
-                        }
-                        firstcoldone = 1;
-                        i++;
-                    }
+        phase_mark(PHASE_INPUT);
+
+        now = phase_clock;
+        step_ns = update * 10 * (int64_t) 1000000;
+        frame_ns = fps ? 1000000000 / fps : step_ns;
+
+        steps = 0;
+        if (step_ns == 0) {
+            /* -u 0 runs flat out */
+            step_groups();
+            stepped = 1;
+            steps = 1;
+            next_step = now;
+        } else {
+            for (steps = 0; now >= next_step; steps++) {
+                /* After a long stall (suspended, say) don't fast forward */
+                if (steps == MAX_CATCHUP) {
+                    steps_dropped += (now - next_step) / step_ns + 1;
+                    next_step = now + step_ns;
+                    break;
                 }
+                step_groups();
+                stepped = 1;
+                next_step += step_ns;
             }
-            /* A simple hack */
-            if (!oldstyle) {
-                y = 1;
-                z = LINES;
-            } else {
-                y = 0;
-                z = LINES - 1;
-            }
-            for (i = y; i <= z; i++) {
-                move(i - y, j);
-
-                if (matrix[i][j].val == 0 || (matrix[i][j].is_head && !rainbow)) {
-                    if (console || xwindow) {
-                        attron(A_ALTCHARSET);
-                    }
-                    attron(COLOR_PAIR(COLOR_WHITE));
-                    if (bold) {
-                        attron(A_BOLD);
-                    }
-                    if (matrix[i][j].val == 0) {
-                        if (console || xwindow) {
-                            addch(183);
-                        } else {
-                            addch('&');
-                        }
-                    } else if (matrix[i][j].val == -1) {
-                        addch(' ');
-                    } else {
-                        addch(matrix[i][j].val);
-                    }
-
-                    attroff(COLOR_PAIR(COLOR_WHITE));
-                    if (bold) {
-                        attroff(A_BOLD);
-                    }
-                    if (console || xwindow) {
-                        attroff(A_ALTCHARSET);
-                    }
-                } else {
-                    if (rainbow) {
-                        int randomColor = rand() % 6;
-
-                        switch (randomColor) {
-                            case 0:
-                                mcolor = COLOR_GREEN;
-                                break;
-                            case 1:
-                                mcolor = COLOR_BLUE;
-                                break;
-                            case 2:
-                                mcolor = COLOR_BLACK;
-                                break;
-                            case 3:
-                                mcolor = COLOR_YELLOW;
-                                break;
-                            case 4:
-                                mcolor = COLOR_CYAN;
-                                break;
-                            case 5:
-                                mcolor = COLOR_MAGENTA;
-                                break;
-                       }
-                    }
-                    attron(COLOR_PAIR(mcolor));
-                    if (matrix[i][j].val == 1) {
-                        if (bold) {
-                            attron(A_BOLD);
-                        }
-                        addch('|');
-                        if (bold) {
-                            attroff(A_BOLD);
-                        }
-                    } else {
-                        if (console || xwindow) {
-                            attron(A_ALTCHARSET);
-                        }
-                        if (bold == 2 ||
-                            (bold == 1 && matrix[i][j].val % 2 == 0)) {
-                            attron(A_BOLD);
-                        }
-                        if (matrix[i][j].val == -1) {
-                            addch(' ');
-                        } else if (lambda && matrix[i][j].val != ' ') {
-                            addstr("λ");
-                        } else {
-                            /* addch doesn't seem to work with unicode
-                             * characters and there was no direct equivalent.
-                             * So, construct a c-style string with the character
-                             * and print that.
-                             */
-                            wchar_t char_array[2];
-                            char_array[0] = matrix[i][j].val;
-                            char_array[1] = 0;
-                            addwstr(char_array);
-                        }
-                        if (bold == 2 ||
-                            (bold == 1 && matrix[i][j].val % 2 == 0)) {
-                            attroff(A_BOLD);
-                        }
-                        if (console || xwindow) {
-                            attroff(A_ALTCHARSET);
-                        }
-                    }
-                    attroff(COLOR_PAIR(mcolor));
+        }
+        if (steps > 0) {
+            phase_mark(PHASE_STEP);
+        }
+
+        if (now >= next_frame) {
+            if ((tty_count > 1 || msgbox.path != NULL) && now >= next_poll) {
+                if (tty_count > 1) {
+                    resize_pending = 1;
+                }
+                if (msgbox.path != NULL) {
+                    message_poll();
+                }
+                next_poll = now + POLL_NS;
+            }
+            if (resize_pending) {
+                resize_screen();
+                resize_pending = 0;
+                phase_mark(PHASE_RESIZE);
+            }
+            /* Nothing moved without a step, unless a key changed the look
+               or --max-bandwidth left something out. A frame held back is
+               tried again when the next one's due. */
+            if ((stepped || force_redraw || thr.behind)
+                && (!thr.on || throttle_frame(now))) {
+                written = term_out.written;
+                sent = clock_ns();
+                render_groups();
+                if (thr.on) {
+                    throttle_sent(clock_ns() - sent, term_out.written - written);
                 }
+                stepped = 0;
+            }
+            if (frame_ns == 0) {
+                next_frame = now;
+            } else {
+                missed = (now - next_frame) / frame_ns;
+                frames_missed += missed;
+                next_frame += (missed + 1) * frame_ns;
             }
         }
 
-        //check if -M and/or -L was used
-        if (msg[0] != '\0') {
-            //Add our message to the screen
-            int msg_x = LINES/2;
-            int msg_y = COLS/2 - strlen(msg)/2;
-            int i = 0;
-
-            //Add space before message
-            move(msg_x-1, msg_y-2);
-            for (i = 0; i < strlen(msg)+4; i++)
-                addch(' ');
-
-            //Write message
-            move(msg_x, msg_y-2);
-            addch(' ');
-            addch(' ');
-            addstr(msg);
-            addch(' ');
-            addch(' ');
-
-            //Add space after message
-            move(msg_x+1, msg_y-2);
-            for (i = 0; i < strlen(msg)+4; i++)
-                addch(' ');
+        /* Paused, there's nothing to do until a key is pressed, a -t
+           terminal changes size or the --message-file changes */
+        if (paused && !force_redraw && !thr.behind) {
+            wait_for_events((tty_count > 1 || msgbox.path != NULL)
+                            ? next_poll : -1);
+            next_step = next_frame = clock_ns();
+        } else {
+            wait_for_events(next_step < next_frame ? next_step : next_frame);
         }
-
-        napms(update * 10);
+        phase_mark(PHASE_WAIT);
     }
     finish();
 }
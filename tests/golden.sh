@@ -0,0 +1,67 @@
+#!/bin/sh
+# Golden frame tests. Runs cmatrix --hash-frames for each case in
+# golden/cases and compares the hash of every frame with the sequence
+# checked in as golden/<name>. Each case runs again with the other step
+# engines, SIMD off and several threads, which have to draw the very same
+# frames (except --engine sparse with -k, whose characters change
+# differently).
+#
+# Usage: golden.sh [cmatrix] to test, golden.sh -u [cmatrix] to write the
+# golden files anew after a change that is meant to alter the animation.
+
+update=0
+if [ "$1" = "-u" ]; then
+    update=1
+    shift
+fi
+cmatrix=${1:-./cmatrix}
+dir=$(dirname "$0")/golden
+out=${TMPDIR:-/tmp}/cmatrix-golden.$$
+trap 'rm -f "$out"' 0
+
+variants="--simd=none --engine=sparse"
+if "$cmatrix" --hash-frames --frames 1 --threads 3 > /dev/null 2>&1; then
+    variants="$variants --threads=3"
+fi
+
+status=0
+while IFS= read -r line; do
+    case $line in
+        ''|'#'*) continue ;;
+    esac
+    name=${line%%:*}
+    args=${line#*:}
+    args=${args# }
+
+    # shellcheck disable=SC2086
+    if ! "$cmatrix" --hash-frames $args > "$out"; then
+        echo "FAIL $name: cmatrix --hash-frames$args failed"
+        status=1
+        continue
+    fi
+    if [ $update = 1 ]; then
+        cp "$out" "$dir/$name"
+        echo "wrote $name"
+        continue
+    fi
+    if ! cmp -s "$out" "$dir/$name"; then
+        frame=$(cmp "$out" "$dir/$name" 2>&1 | sed -n 's/.* line \([0-9]*\).*/\1/p')
+        echo "FAIL $name: frame ${frame:-?} differs ($args)"
+        status=1
+        continue
+    fi
+
+    for v in $variants; do
+        case "$v $args " in
+            --engine=sparse*' -k '*) continue ;;
+        esac
+        # shellcheck disable=SC2086
+        if ! "$cmatrix" --hash-frames $args $v | cmp -s - "$dir/$name"; then
+            echo "FAIL $name: differs with $v ($args)"
+            status=1
+        fi
+    done
+    echo "ok $name"
+done < "$dir/cases"
+
+exit $status
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+# Several -t terminals of different sizes, resized one at a time while
+# cmatrix runs. Each has to keep being drawn at its own size, and the ones
+# that end up the same size have to get the same frames.
+#
+# Usage: ttys.py [cmatrix [option...]]
+
+import fcntl
+import os
+import pty
+import re
+import select
+import struct
+import subprocess
+import sys
+import termios
+import time
+
+cmatrix = sys.argv[1] if len(sys.argv) > 1 else './cmatrix'
+sizes = [(24, 80), (30, 100), (36, 110)]
+ttys = []
+for lines, cols in sizes:
+    master, slave = pty.openpty()
+    fcntl.ioctl(slave, termios.TIOCSWINSZ, struct.pack('HHHH', lines, cols, 0, 0))
+    ttys.append({'master': master, 'slave': slave, 'out': b''})
+
+args = [cmatrix, '-u', '1'] + sys.argv[2:]
+for t in ttys:
+    args += ['-t', os.ttyname(t['slave'])]
+proc = subprocess.Popen(args, env=dict(os.environ, TERM='xterm'),
+                        stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL,
+                        stderr=subprocess.PIPE, start_new_session=True)
+
+
+def pump(seconds):
+    end = time.time() + seconds
+    while time.time() < end:
+        ready, _, _ = select.select([t['master'] for t in ttys], [], [], 0.01)
+        for t in ttys:
+            if t['master'] in ready:
+                try:
+                    t['out'] += os.read(t['master'], 1 << 16)
+                except OSError:
+                    pass
+
+
+def resize(n, lines, cols):
+    fcntl.ioctl(ttys[n]['slave'], termios.TIOCSWINSZ,
+                struct.pack('HHHH', lines, cols, 0, 0))
+
+
+def fail(why):
+    print('FAIL ' + why)
+    proc.kill()
+    sys.exit(1)
+
+
+def drawn_at(n, lines):
+    # A cursor move to the bottom line of the new size
+    return re.search(rb'\033\[%d;\d+H' % lines, ttys[n]['out']) is not None
+
+
+pump(1.5)
+if proc.poll() is not None:
+    fail('cmatrix exited: ' + proc.stderr.read().decode())
+
+# Every terminal is a size of its own, and one changes to yet another:
+# its old group has to go before the new one comes
+for t in ttys:
+    t['out'] = b''
+resize(1, 40, 120)
+pump(1.5)
+if proc.poll() is not None:
+    fail('cmatrix exited after a resize: ' + proc.stderr.read().decode())
+if not drawn_at(1, 40):
+    fail('the resized terminal was not drawn at its new size')
+if drawn_at(2, 40) or not drawn_at(2, 36):
+    fail('a terminal that kept its size was drawn at another')
+
+# And the others go the same way, which leaves one group
+resize(0, 40, 120)
+resize(2, 40, 120)
+pump(1.5)
+os.write(ttys[0]['master'], b'p')
+pump(1.0)
+for t in ttys:
+    t['out'] = b''
+os.write(ttys[0]['master'], b'p')
+pump(1.0)
+os.write(ttys[0]['master'], b'p')
+pump(1.0)
+if not ttys[0]['out'] or not ttys[0]['out'] == ttys[1]['out'] == ttys[2]['out']:
+    fail('terminals of the same size got different frames')
+
+os.write(ttys[0]['master'], b'q')
+pump(0.5)
+try:
+    status = proc.wait(timeout=5)
+except subprocess.TimeoutExpired:
+    fail('cmatrix did not quit')
+errors = proc.stderr.read().decode()
+if status != 0 or errors:
+    fail('cmatrix quit with %d: %s' % (status, errors))
+print('ok ttys')